@@ -0,0 +1,76 @@
+/* * * * * * * * * * * * * * * * * * jwdpmi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2026 - 2026 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <atomic>
+#include <limits>
+#include <jw/thread.h>
+
+namespace jw::detail
+{
+    struct barrier_no_completion
+    {
+        void operator()() const noexcept { }
+    };
+}
+
+namespace jw
+{
+    // Reusable thread barrier, blocking on the scheduler.  The completion
+    // function is called by the last thread to arrive, before the others
+    // are woken up.
+    template<typename CompletionFunction = detail::barrier_no_completion>
+    class barrier
+    {
+    public:
+        class arrival_token
+        {
+            friend class barrier;
+            arrival_token(std::uint32_t p) noexcept : phase { p } { }
+            std::uint32_t phase;
+        };
+
+        static constexpr std::ptrdiff_t max() noexcept { return std::numeric_limits<std::ptrdiff_t>::max(); }
+
+        constexpr explicit barrier(std::ptrdiff_t expected, CompletionFunction f = CompletionFunction { })
+            : expected { expected }, remaining { expected }, completion { std::move(f) } { }
+
+        barrier(barrier&&) = delete;
+        barrier(const barrier&) = delete;
+        barrier& operator=(barrier&&) = delete;
+        barrier& operator=(const barrier&) = delete;
+
+        [[nodiscard]] arrival_token arrive(std::ptrdiff_t n = 1)
+        {
+            const arrival_token token { phase.load(std::memory_order_relaxed) };
+            if (remaining.fetch_sub(n, std::memory_order_acq_rel) == n)
+            {
+                completion();
+                remaining.store(expected.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                phase.fetch_add(1, std::memory_order_release);
+                waiters.notify_all();
+            }
+            return token;
+        }
+
+        void wait(arrival_token&& token) const
+        {
+            waiters.wait_while([this, p = token.phase] { return phase.load(std::memory_order_acquire) == p; });
+        }
+
+        void arrive_and_wait() { wait(arrive()); }
+
+        void arrive_and_drop()
+        {
+            expected.fetch_sub(1, std::memory_order_relaxed);
+            (void) arrive();
+        }
+
+    private:
+        std::atomic<std::ptrdiff_t> expected;
+        std::atomic<std::ptrdiff_t> remaining;
+        std::atomic<std::uint32_t> phase { 0 };
+        [[no_unique_address]] CompletionFunction completion;
+        mutable detail::wait_queue waiters;
+    };
+}
@@ -105,6 +105,10 @@ namespace jw::chrono
         // for short intervals.
         static duration to_duration(std::int64_t);
 
+        // Convert a duration to a number of TSC ticks, the inverse of
+        // to_duration().  Returns zero if the TSC is not calibrated.
+        static std::int64_t to_count(duration);
+
         // Convert an absolute tsc_count to a time_point.  Unlike now(), this
         // uses floating-point math.  Accuracy is reduced the further away the
         // time stamp is from now().
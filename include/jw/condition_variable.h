@@ -0,0 +1,136 @@
+/* * * * * * * * * * * * * * * * * * jwdpmi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2026 - 2026 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <mutex>
+#include <condition_variable>
+#include <jw/thread.h>
+#include <jw/mutex.h>
+#include "jwdpmi_config.h"
+
+namespace jw
+{
+    using std::cv_status;
+
+    // Condition variable that works with any lockable type.  Waiting threads
+    // are blocked on the scheduler, and notify_one()/notify_all() may be
+    // called from interrupt handlers.
+    class condition_variable_any
+    {
+    public:
+        constexpr condition_variable_any() noexcept = default;
+        condition_variable_any(condition_variable_any&&) = delete;
+        condition_variable_any(const condition_variable_any&) = delete;
+        condition_variable_any& operator=(condition_variable_any&&) = delete;
+        condition_variable_any& operator=(const condition_variable_any&) = delete;
+
+        void notify_one() noexcept { waiters.notify_one(); }
+        void notify_all() noexcept { waiters.notify_all(); }
+
+        template<typename L>
+        void wait(L& lock)
+        {
+            finally relock { [&lock] { lock.lock(); } };
+            waiters.wait_while(unlock_once(lock));
+        }
+
+        template<typename L, typename P>
+        void wait(L& lock, P pred)
+        {
+            while (not pred()) wait(lock);
+        }
+
+        template<typename L, class Clock, class Duration>
+        cv_status wait_until(L& lock, const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            {
+                finally relock { [&lock] { lock.lock(); } };
+                waiters.wait_while_until(unlock_once(lock), abs_time);
+            }
+            return Clock::now() < abs_time ? cv_status::no_timeout : cv_status::timeout;
+        }
+
+        template<typename L, class Clock, class Duration, typename P>
+        bool wait_until(L& lock, const std::chrono::time_point<Clock, Duration>& abs_time, P pred)
+        {
+            while (not pred())
+                if (wait_until(lock, abs_time) == cv_status::timeout)
+                    return pred();
+            return true;
+        }
+
+        template<typename L, class Rep, class Period>
+        cv_status wait_for(L& lock, const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return wait_until(lock, config::thread_clock::now() + rel_time);
+        }
+
+        template<typename L, class Rep, class Period, typename P>
+        bool wait_for(L& lock, const std::chrono::duration<Rep, Period>& rel_time, P pred)
+        {
+            return wait_until(lock, config::thread_clock::now() + rel_time, std::move(pred));
+        }
+
+    private:
+        // The lock is released only after the thread is placed on the wait
+        // queue, with interrupts masked, so no notification can be missed.
+        template<typename L>
+        static auto unlock_once(L& lock)
+        {
+            return [&lock, waited = false]() mutable
+            {
+                if (waited) return false;
+                lock.unlock();
+                return waited = true;
+            };
+        }
+
+        detail::wait_queue waiters;
+    };
+
+    // Condition variable for use with std::unique_lock<jw::mutex>.
+    class condition_variable
+    {
+    public:
+        constexpr condition_variable() noexcept = default;
+        condition_variable(condition_variable&&) = delete;
+        condition_variable(const condition_variable&) = delete;
+        condition_variable& operator=(condition_variable&&) = delete;
+        condition_variable& operator=(const condition_variable&) = delete;
+
+        void notify_one() noexcept { cv.notify_one(); }
+        void notify_all() noexcept { cv.notify_all(); }
+
+        void wait(std::unique_lock<mutex>& lock) { cv.wait(lock); }
+
+        template<typename P>
+        void wait(std::unique_lock<mutex>& lock, P pred) { cv.wait(lock, std::move(pred)); }
+
+        template<class Clock, class Duration>
+        cv_status wait_until(std::unique_lock<mutex>& lock, const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return cv.wait_until(lock, abs_time);
+        }
+
+        template<class Clock, class Duration, typename P>
+        bool wait_until(std::unique_lock<mutex>& lock, const std::chrono::time_point<Clock, Duration>& abs_time, P pred)
+        {
+            return cv.wait_until(lock, abs_time, std::move(pred));
+        }
+
+        template<class Rep, class Period>
+        cv_status wait_for(std::unique_lock<mutex>& lock, const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return cv.wait_for(lock, rel_time);
+        }
+
+        template<class Rep, class Period, typename P>
+        bool wait_for(std::unique_lock<mutex>& lock, const std::chrono::duration<Rep, Period>& rel_time, P pred)
+        {
+            return cv.wait_for(lock, rel_time, std::move(pred));
+        }
+
+    private:
+        condition_variable_any cv;
+    };
+}
@@ -4,6 +4,8 @@
 
 #pragma once
 #include <chrono>
+#include <jw/detail/scheduler.h>
+#include "jwdpmi_config.h"
 
 namespace jw::detail
 {
@@ -13,13 +15,13 @@ namespace jw::detail
         template <class Rep, class Period>
         bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time)
         {
-            return not yield_while_for([this] { return not this->try_lock(); }, rel_time);
+            return try_lock_until(config::thread_clock::now() + rel_time);
         }
 
         template <class Clock, class Duration>
         bool try_lock_until(const std::chrono::time_point<Clock, Duration>& abs_time)
         {
-            return not yield_while_until([this] { return not this->try_lock(); }, abs_time);
+            return not this->waiters.wait_while_until([this] { return not this->try_lock(); }, abs_time);
         }
     };
 }
@@ -4,26 +4,170 @@
 #pragma once
 #include <jw/dpmi/irq_check.h>
 #include <jw/dpmi/alloc.h>
+#include <jw/dpmi/fpu.h>
 #include <jw/function.h>
 #include <jw/main.h>
 #include <jw/detail/eh_globals.h>
 #include <jw/debug.h>
+#include <jw/chrono.h>
 #include <functional>
+#include <atomic>
+#include <bit>
 #include <memory>
 #include <deque>
 #include <set>
+#include <array>
+#include <vector>
 #include <optional>
 #include <unwind.h>
 
 namespace jw
 {
     struct thread;
+
+    // Scheduling priority.  A runnable thread is always selected before
+    // threads of lower priority, but a low-priority thread that has been
+    // passed over config::thread_starvation_limit times gets a turn anyway.
+    enum class thread_priority : std::uint8_t
+    {
+        idle,
+        low,
+        normal,
+        high,
+        realtime
+    };
+
+    struct thread_stats_t
+    {
+        // Total time spent running this thread, in CPU cycles.  Use
+        // chrono::tsc::to_duration() to convert to nanoseconds.
+        std::uint64_t cycles;
+
+        // Number of times this thread was scheduled.
+        std::uint64_t switches;
+
+        // Maximum and average time between becoming runnable and being
+        // scheduled, in CPU cycles.
+        std::uint32_t max_latency, avg_latency;
+
+        // Distribution of the above.  Bucket 0 counts latencies below 1024
+        // cycles, each next bucket covers twice the range of the previous
+        // one, and the last bucket is open-ended.
+        std::array<std::uint32_t, 16> latency_histogram;
+
+        // Highest amount of stack space used so far, in bytes.
+        std::size_t stack_used;
+    };
 }
 
 namespace jw::detail
 {
     using thread_id = std::uint32_t;
 
+    // How FPU registers are switched between threads.
+    enum class fpu_switch_mode : std::uint8_t
+    {
+        eager,          // save and restore on every thread switch
+        lazy,           // trap on first use via CR0.TS, written in ring 3
+        lazy_ring0      // same, but CR0 is only writable in ring 0
+    };
+
+    // Memory for a thread stack.  Stacks are rounded up to a power-of-two
+    // size class, and kept in a cache for re-use when released.  With
+    // config::thread_guard_pages, the stack is allocated in its own DPMI
+    // memory block, with an uncommitted guard page below it.
+    struct thread_stack
+    {
+        constexpr thread_stack() noexcept = default;
+        thread_stack(thread_stack&&) noexcept;
+        thread_stack& operator=(thread_stack&&) noexcept;
+        ~thread_stack();
+
+        thread_stack(const thread_stack&) = delete;
+        thread_stack& operator=(const thread_stack&) = delete;
+
+        // Obtain a stack of at least the given size, from the cache if
+        // possible.
+        static thread_stack allocate(std::size_t bytes);
+
+        // Return a stack to the cache, or free it if the cache is full.
+        static void release(thread_stack&&) noexcept;
+
+        // Free all cached stacks.
+        static void clear_cache() noexcept;
+
+        std::byte* data() const noexcept { return memory.data(); }
+        std::size_t size_bytes() const noexcept { return memory.size_bytes(); }
+        bool guarded() const noexcept { return block.has_value(); }
+
+    private:
+        std::span<std::byte> memory { };
+        std::optional<dpmi::memory_base> block { };
+    };
+
+    // Fixed-size lock-free queue of functions to be called on a thread.  It
+    // may be written to from interrupt handlers, even when nested, without
+    // masking interrupts.  Only the owning thread may call run().
+    template<typename F, std::size_t N>
+    struct invoke_mailbox
+    {
+        static_assert(std::has_single_bit(N));
+
+        constexpr invoke_mailbox() noexcept = default;
+        ~invoke_mailbox()
+        {
+            for (auto h = head.load(); h != tail.load(); ++h)
+                slots[h % N].get()->~F();
+        }
+
+        invoke_mailbox(const invoke_mailbox&) = delete;
+        invoke_mailbox& operator=(const invoke_mailbox&) = delete;
+
+        // Returns false if the mailbox is full.
+        bool try_push(F&& func) noexcept
+        {
+            auto t = tail.load(std::memory_order_relaxed);
+            do
+            {
+                if (t - head.load(std::memory_order_acquire) >= N) return false;
+            } while (not tail.compare_exchange_weak(t, t + 1, std::memory_order_relaxed));
+
+            auto& s = slots[t % N];
+            new (s.storage) F { std::move(func) };
+            s.full.store(true, std::memory_order_release);
+            return true;
+        }
+
+        // Call all queued functions, in order.
+        void run()
+        {
+            while (true)
+            {
+                const auto h = head.load(std::memory_order_relaxed);
+                auto& s = slots[h % N];
+                if (not s.full.load(std::memory_order_acquire)) return;
+                F f { std::move(*s.get()) };
+                s.get()->~F();
+                s.full.store(false, std::memory_order_relaxed);
+                head.store(h + 1, std::memory_order_release);
+                f();
+            }
+        }
+
+    private:
+        struct slot
+        {
+            F* get() noexcept { return std::launder(reinterpret_cast<F*>(storage)); }
+
+            alignas(F) std::byte storage[sizeof(F)];
+            std::atomic<bool> full { false };
+        };
+
+        std::array<slot, N> slots { };
+        std::atomic<std::uint32_t> head { 0 };
+        std::atomic<std::uint32_t> tail { 0 };
+    };
+
     struct [[gnu::packed]] thread_context
     {
         std::uint32_t gs;
@@ -42,9 +186,62 @@ namespace jw::detail
     template <typename T = std::byte>
     using thread_allocator = monomorphic_allocator<dpmi::locked_pool_resource, T>;
 
+    struct thread;
+
+    // Intrusive doubly-linked list of threads.  A thread is a member of at
+    // most one queue at a time.  Callers must mask interrupts.
+    struct thread_queue
+    {
+        constexpr thread_queue() noexcept = default;
+
+        thread* front() const noexcept { return first; }
+        bool empty() const noexcept { return first == nullptr; }
+
+        void push_back(thread*) noexcept;
+        void erase(thread*) noexcept;
+
+    private:
+        thread_queue(thread_queue&&) = delete;
+        thread_queue(const thread_queue&) = delete;
+        thread_queue& operator=(thread_queue&&) = delete;
+        thread_queue& operator=(const thread_queue&) = delete;
+
+        thread* first { nullptr };
+        thread* last { nullptr };
+    };
+
+    // Queue of threads that are blocked until notified.  Waiting threads are
+    // removed from the run queue, so they cost nothing while blocked.
+    // Notifying is safe from interrupt context.
+    struct wait_queue
+    {
+        constexpr wait_queue() noexcept = default;
+
+        // Block the current thread while the given condition evaluates to
+        // true.  The condition is evaluated with interrupts masked, and
+        // re-evaluated after every wakeup.  Spurious wakeups may occur.
+        template<typename F>
+        void wait_while(F&& condition);
+
+        // Same as wait_while(), with a timeout.  Returns true if the
+        // condition was still true when the time point was reached.
+        template<typename F, typename P>
+        bool wait_while_until(F&& condition, const P& time_point);
+
+        // Wake up one or all waiting threads.
+        void notify_one() noexcept;
+        void notify_all() noexcept;
+
+        bool empty() const noexcept { return queue.empty(); }
+
+    private:
+        thread_queue queue;
+    };
+
     struct thread
     {
         friend struct scheduler;
+        friend struct thread_queue;
 
         static constexpr inline thread_id main_thread_id = 1;
 
@@ -60,15 +257,21 @@ namespace jw::detail
 
         bool active() const noexcept { return state != finished; }
         void suspend() noexcept { suspended = true; }
-        void resume() noexcept { suspended = false; }
-        void cancel() noexcept { canceled = true; }
-        void detach() noexcept { detached = true; }
+        void resume() noexcept;
+        void cancel() noexcept { canceled = true; wake(); }
+        void detach() noexcept;
+        void wake() noexcept;
+        void join();
+        void set_priority(thread_priority) noexcept;
         auto get_state() const noexcept { return state; }
+        auto get_priority() const noexcept { return priority; }
         bool is_canceled() const noexcept { return canceled; }
         bool is_suspended() const noexcept { return suspended; }
+        bool is_sleeping() const noexcept { return sleeping; }
         bool is_unwinding() const noexcept { return unwinding; }
+        thread_stats_t get_stats() const noexcept;
 
-        template<typename F> void invoke(F&& function) { invoke_list.emplace_back(std::forward<F>(function)); }
+        template<typename F> void invoke(F&& function);
         template<typename F> void atexit(F&& function) { atexit_list.emplace_back(std::forward<F>(function)); }
 
 #ifdef NDEBUG
@@ -87,18 +290,21 @@ namespace jw::detail
         {
             if (function.data() == nullptr) return;
             destroy(function.data());
-            memres.deallocate(function.data(), function.size() + stack.size());
+            memres.deallocate(function.data(), function.size());
+            thread_stack::release(std::move(stack));
         }
 
         thread();
 
         template <typename F, typename function_t = std::remove_cvref_t<F>>
         thread(F&& func, std::size_t stack_bytes)
-            : thread { allocate<function_t>(stack_bytes), std::forward<F>(func) } { }
+            : thread { thread_stack::allocate(stack_bytes), allocate<function_t>(), std::forward<F>(func) } { }
 
     private:
+        friend struct thread_stack;
+
         template <typename F, typename function_t = std::remove_cvref_t<F>>
-        thread(std::span<std::byte> span, F&& func);
+        thread(thread_stack&& stack, std::span<std::byte> span, F&& func);
 
         thread& operator=(const thread&) = delete;
         thread(const thread&) = delete;
@@ -108,9 +314,9 @@ namespace jw::detail
         void operator()() { call(function.data()); }
 
         template<typename F>
-        static auto allocate(std::size_t stack)
+        static auto allocate()
         {
-            const auto n = stack + sizeof(F);
+            const auto n = sizeof(F);
             const auto a = std::max(alignof(F), 4ul);
             auto* const p = memres.allocate(n, a);
             return std::span<std::byte> { static_cast<std::byte*>(p), n };
@@ -127,18 +333,34 @@ namespace jw::detail
         const std::span<std::byte> function { };
         void (*call)(void*);
         void (*destroy)(void*);
-        const std::span<std::byte> stack;
+        thread_stack stack;
         thread_context* context; // points to esp during context switch
+        chrono::tsc_count wake_time { 0 };
         abi::__cxa_eh_globals eh_globals { };
         ::_Unwind_Exception unwind_exception;
         int errno { 0 };
+        dpmi::fpu_registers fpu;
+        thread_stats_t stats { };
+        std::uint64_t latency_sum { 0 };
+        chrono::tsc_count runnable_since { 0 };
         thread_state state { starting };
+        thread_priority priority { thread_priority::normal };
         bool suspended { false };
         bool canceled { false };
         bool detached { false };
         bool unwinding { false };
+        bool sleeping { false };
+
+        thread_queue* queue { nullptr };
+        thread* next { nullptr };
+        thread* prev { nullptr };
+        wait_queue exit_queue { };
 
+        // Functions queued by invoke().  If the mailbox is full, they go to
+        // invoke_list instead, until that is drained.
+        invoke_mailbox<jw::function<void(), 4>, config::thread_invoke_mailbox_size> mailbox { };
         std::deque<jw::function<void(), 4>, thread_allocator<jw::function<void(), 4>>> invoke_list;
+        bool invoke_overflow { false };
         std::deque<jw::function<void(), 4>> atexit_list { };
 
 #ifndef NDEBUG
@@ -155,6 +377,8 @@ namespace jw::detail
         friend int ::__wrap_main(int, const char**);
         friend struct ::jw::thread;
         friend struct ::jw::init;
+        friend struct thread;
+        friend struct wait_queue;
 
         [[gnu::hot]] static void yield();
         [[gnu::hot]] static void safe_yield();
@@ -165,9 +389,19 @@ namespace jw::detail
         static thread_id current_thread_id() noexcept;
         static thread* get_thread(thread_id) noexcept;
 
+        // Remove the current thread from the run queue until the TSC reaches
+        // the given count, or until it is woken up early (by cancel() or
+        // invoke()).  The deadline may be overshot by one scheduler round.
+        static void sleep_until(chrono::tsc_count);
+
         [[noreturn]] static void forced_unwind();
         static void catch_forced_unwind() noexcept;
 
+        // Called on a device-not-available exception.  Loads the FPU
+        // registers for the current thread.  Returns false if the exception
+        // was not caused by lazy FPU switching.
+        static bool handle_fpu_trap() noexcept;
+
         template<typename F>
         static void invoke_main(F&& function);
         template<typename F>
@@ -181,9 +415,29 @@ namespace jw::detail
 
     private:
         using set_type = std::set<thread, std::less<void>, thread_allocator<thread>>;
+
+        struct sleeper
+        {
+            chrono::tsc_count wake_time;
+            thread* t;
+        };
+        using sleep_queue_type = std::vector<sleeper, thread_allocator<sleeper>>;
+
+        static constexpr std::size_t num_priorities = static_cast<std::size_t>(thread_priority::realtime) + 1;
+
         template<typename F>
-        static thread* create_thread(F&& func, std::size_t stack_size);
+        static thread* create_thread(F&& func, std::size_t stack_size, thread_priority);
         static void atexit(thread*) noexcept;
+        static void wake_sleepers() noexcept;
+        static void move(thread*, thread_queue&) noexcept;
+        static void make_ready(thread*) noexcept;
+        static void account_switch(thread*) noexcept;
+        static void block(thread_queue&) noexcept;
+        static void block(thread_queue&, chrono::tsc_count);
+        static void retire(thread*) noexcept;
+        static thread_queue* select_queue() noexcept;
+        static thread_queue& ready_queue(const thread* t) noexcept { return ready[static_cast<std::size_t>(t->priority)]; }
+        static bool is_ready(const thread* t) noexcept { return t->queue == &ready_queue(t); }
 
         template<bool>
         static void do_yield();
@@ -198,17 +452,135 @@ namespace jw::detail
         static void run_thread() noexcept;
 
         static void setup();
+        static void setup_fpu(fpu_switch_mode, bool clts);
         static void kill_all();
+        static void switch_fpu(thread*) noexcept;
+        static void load_fpu(thread*) noexcept;
+        static void set_fpu_trap(bool) noexcept;
 
         inline static constinit std::optional<dpmi::locked_pool_resource> memres { std::nullopt };
         inline static constinit std::optional<set_type> threads { std::nullopt };
-        inline static constinit std::optional<set_type::iterator> iterator { std::nullopt };
+        // A detached thread that finished while running on its own stack.
+        // It is destroyed at the next switch, from another thread's stack.
+        inline static constinit std::optional<set_type::node_type> dead { std::nullopt };
+        inline static constinit std::optional<sleep_queue_type> sleep_queue { std::nullopt };
+        inline static constinit thread* current { nullptr };
+
+        // Runnable threads, one queue per priority level.  The current
+        // thread is at the front of its queue.
+        inline static constinit std::array<thread_queue, num_priorities> ready { };
+        inline static constinit std::array<std::uint32_t, num_priorities> passed_over { };
+        // Sleeping threads, and finished threads that are not detached yet.
+        inline static constinit thread_queue parked { };
+        inline static constinit thread_queue suspended { };
+
+        // Thread whose state is currently held in the FPU registers.
+        inline static constinit thread* fpu_owner { nullptr };
+        inline static constinit fpu_switch_mode fpu_mode { fpu_switch_mode::eager };
+        inline static constinit bool fpu_trap { false };
+        // CR0.TS can be cleared with 'clts' without entering ring 0.
+        inline static constinit bool fpu_clts { false };
+        // Time at which the current thread was scheduled, for statistics.
+        inline static constinit chrono::tsc_count switched_in { 0 };
+        inline static constinit bool have_tsc { false };
+        // FPU state for new threads, saved during initialization.
+        inline static constinit dpmi::fpu_registers initial_fpu { };
     };
 
+    inline void thread_queue::push_back(thread* t) noexcept
+    {
+        t->queue = this;
+        t->next = nullptr;
+        t->prev = last;
+        if (last != nullptr) last->next = t;
+        else first = t;
+        last = t;
+    }
+
+    inline void thread_queue::erase(thread* t) noexcept
+    {
+        if (t->prev != nullptr) t->prev->next = t->next;
+        else first = t->next;
+        if (t->next != nullptr) t->next->prev = t->prev;
+        else last = t->prev;
+        t->queue = nullptr;
+        t->next = t->prev = nullptr;
+    }
+
+    inline void scheduler::move(thread* t, thread_queue& q) noexcept
+    {
+        if (t->queue != nullptr) t->queue->erase(t);
+        q.push_back(t);
+    }
+
+    // Move a thread to its run queue.  Interrupts must be masked.
+    inline void scheduler::make_ready(thread* t) noexcept
+    {
+        if constexpr (config::collect_thread_stats)
+            if (have_tsc) [[likely]] t->runnable_since = chrono::rdtsc();
+        move(t, ready_queue(t));
+    }
+
+    // Move the current thread from the run queue to the given queue.  It
+    // will not be scheduled until woken up.  Interrupts must be masked.
+    inline void scheduler::block(thread_queue& q) noexcept
+    {
+        move(current, q);
+    }
+
+    inline void thread::resume() noexcept
+    {
+        dpmi::interrupt_mask no_interrupts_please { };
+        suspended = false;
+        if (queue == &scheduler::suspended)
+            scheduler::make_ready(this);
+    }
+
+    inline void thread::wake() noexcept
+    {
+        dpmi::interrupt_mask no_interrupts_please { };
+        sleeping = false;
+        if (queue != nullptr and queue != &scheduler::suspended and not scheduler::is_ready(this))
+            scheduler::make_ready(this);
+    }
+
+    template<typename F>
+    inline void thread::invoke(F&& function)
+    {
+        jw::function<void(), 4> f { std::forward<F>(function) };
+        if (invoke_overflow or not mailbox.try_push(std::move(f))) [[unlikely]]
+        {
+            dpmi::interrupt_mask no_interrupts_please { };
+            invoke_list.emplace_back(std::move(f));
+            invoke_overflow = true;
+        }
+        wake();
+    }
+
+    inline void thread::join()
+    {
+        resume();
+        exit_queue.wait_while([this] { return active(); });
+    }
+
+    inline void thread::set_priority(thread_priority p) noexcept
+    {
+        dpmi::interrupt_mask no_interrupts_please { };
+        const bool runnable = scheduler::is_ready(this);
+        priority = p;
+        if (runnable) scheduler::move(this, scheduler::ready_queue(this));
+    }
+
+    inline void thread::detach() noexcept
+    {
+        detached = true;
+        if (state == finished) wake();
+    }
+
     inline bool scheduler::is_current_thread(const thread* t) noexcept { return current_thread() == t; }
     inline bool scheduler::is_current_thread(thread_id id) noexcept { return current_thread_id() == id; }
-    inline thread* scheduler::current_thread() noexcept { return const_cast<thread*>(&**iterator); }
-    inline thread_id scheduler::current_thread_id() noexcept { return (*iterator)->id; }
+    inline thread* scheduler::current_thread() noexcept { return current; }
+    inline thread_id scheduler::current_thread_id() noexcept { return current->id; }
 
     inline thread* scheduler::get_thread(thread_id id) noexcept
     {
@@ -217,6 +589,61 @@ namespace jw::detail
         return const_cast<thread*>(&*it);
     }
 
+    template<typename F>
+    inline void wait_queue::wait_while(F&& condition)
+    {
+        if (dpmi::in_irq_context()) [[unlikely]]
+        {
+            while (condition()) { }
+            return;
+        }
+
+        while (true)
+        {
+            {
+                dpmi::interrupt_mask no_interrupts_please { };
+                if (not condition()) return;
+                scheduler::block(queue);
+            }
+            scheduler::yield();
+        }
+    }
+
+    template<typename F, typename P>
+    inline bool wait_queue::wait_while_until(F&& condition, const P& time_point)
+    {
+        while (true)
+        {
+            const auto now = P::clock::now();
+            std::int64_t ticks = 0;
+            if (now < time_point)
+                ticks = chrono::tsc::to_count(std::chrono::ceil<chrono::tsc::duration>(time_point - now));
+
+            {
+                dpmi::interrupt_mask no_interrupts_please { };
+                if (not condition()) return false;
+                if (now >= time_point) return true;
+
+                // Without a usable TSC, this degrades to polling.
+                if (ticks > 0 and not dpmi::in_irq_context()) [[likely]]
+                    scheduler::block(queue, chrono::rdtsc() + ticks);
+            }
+            scheduler::yield();
+        }
+    }
+
+    inline void wait_queue::notify_one() noexcept
+    {
+        dpmi::interrupt_mask no_interrupts_please { };
+        if (auto* const t = queue.front()) t->wake();
+    }
+
+    inline void wait_queue::notify_all() noexcept
+    {
+        dpmi::interrupt_mask no_interrupts_please { };
+        while (auto* const t = queue.front()) t->wake();
+    }
+
     template<typename F>
     inline void scheduler::invoke_main(F&& function)
     {
@@ -227,23 +654,28 @@ namespace jw::detail
     template<typename F>
     inline void scheduler::invoke_next(F&& function)
     {
-        if (not threads->empty())
+        thread* next;
         {
-            auto next = *iterator;
-            if (++next == threads->end()) next = threads->begin();
-            const_cast<thread&>(*next).invoke(std::forward<F>(function));
+            dpmi::interrupt_mask no_interrupts_please { };
+            next = is_ready(current) ? current->next : nullptr;
+            for (auto q = ready.rbegin(); q != ready.rend() and next == nullptr; ++q)
+                next = q->front();
         }
+        if (next != nullptr) next->invoke(std::forward<F>(function));
         else if (dpmi::in_irq_context()) current_thread()->invoke(std::forward<F>(function));
         else std::forward<F>(function)();
     }
 
     template<typename F>
-    inline thread* scheduler::create_thread(F&& func, std::size_t stack_size)
+    inline thread* scheduler::create_thread(F&& func, std::size_t stack_size, thread_priority priority)
     {
         debug::trap_mask dont_trace_here { };
         dpmi::interrupt_mask no_interrupts_please { };
         auto i = threads->emplace_hint(threads->end(), std::forward<F>(func), stack_size);
-        return const_cast<thread*>(&*i);
+        auto* const t = const_cast<thread*>(&*i);
+        t->priority = priority;
+        make_ready(t);
+        return t;
     }
 
     inline thread::thread()
@@ -255,11 +687,12 @@ namespace jw::detail
     }
 
     template <typename F, typename function_t>
-    inline thread::thread(std::span<std::byte> span, F&& func)
-        : function { span.first(sizeof(function_t)) }
+    inline thread::thread(thread_stack&& s, std::span<std::byte> span, F&& func)
+        : function { span }
         , call { do_call<function_t> }
         , destroy { do_destroy<function_t> }
-        , stack { span.last(span.size() - sizeof(function_t)) }
+        , stack { std::move(s) }
+        , fpu { scheduler::initial_fpu }
         , invoke_list { scheduler::memory_resource() }
 #       ifndef NDEBUG
         , name { "anonymous thread", scheduler::memory_resource() }
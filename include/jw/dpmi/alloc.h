@@ -14,6 +14,8 @@
 #include <map>
 #include <memory_resource>
 #include <optional>
+#include <algorithm>
+#include <array>
 
 namespace jw::dpmi
 {
@@ -83,11 +85,17 @@ namespace jw::dpmi
     // When specifying a pool size, make sure to account for overhead
     // (reallocation, fragmentation, alignment overhead).  And keep in mind
     // that the resource itself must also be allocated in locked memory!
+    // With auto_grow, an allocation that doesn't fit outside of interrupt
+    // context grows the pool instead of throwing std::bad_alloc.
     struct locked_pool_resource final : public pool_resource
     {
         using base = pool_resource;
         locked_pool_resource() noexcept : base { locking_resource() } { }
-        locked_pool_resource(std::size_t size_bytes) : locked_pool_resource { } { grow(size_bytes); }
+        locked_pool_resource(std::size_t size_bytes, bool auto_grow = false) : locked_pool_resource { }
+        {
+            grows = auto_grow;
+            grow(size_bytes);
+        }
 
         constexpr locked_pool_resource(locked_pool_resource&& o) noexcept = default;
         constexpr locked_pool_resource& operator=(locked_pool_resource&& o) noexcept = default;
@@ -99,8 +107,15 @@ namespace jw::dpmi
     private:
         virtual void do_grow(std::size_t bytes) override { grow_alloc<interrupt_mask>(bytes); }
         virtual void do_grow(const std::span<std::byte>& ptr) noexcept override { grow_impl<interrupt_mask>(ptr); }
-        virtual void auto_grow(std::size_t) override { throw std::bad_alloc { }; }
+        virtual void auto_grow(std::size_t n) override
+        {
+            // Memory can't be allocated and locked in interrupt context.
+            if (not grows or in_irq_context()) throw std::bad_alloc { };
+            grow_alloc<interrupt_mask>(std::max(n * 2, size() / 2));
+        }
         [[nodiscard]] virtual void* do_allocate(std::size_t n, std::size_t a) override { return allocate_impl<interrupt_mask>(n, a); }
+
+        bool grows { false };
     };
 
     // Allocator based on locked_pool_resource
@@ -162,6 +177,187 @@ namespace jw::dpmi
         std::shared_ptr<locked_pool_resource> res;
     };
 
+    // Monotonic memory resource for short-lived allocations, such as
+    // per-frame scratch memory.  Allocation is a pointer bump, deallocate()
+    // does nothing, and all memory is released at once by reset().
+    // When the arena is full, allocations spill over to the upstream
+    // resource, and the next reset() grows the arena to fit.  Works with both
+    // std::pmr::polymorphic_allocator and monomorphic_allocator.
+    // There is no locking, so use one arena per context: an arena must not
+    // be shared between threads, or between a thread and an interrupt
+    // handler.  An arena that is only used from interrupt handlers needs
+    // locking_resource() as upstream, and must not overflow there.
+    struct arena_resource final : std::pmr::memory_resource
+    {
+        arena_resource(std::size_t size_bytes, std::pmr::memory_resource* upstream_resource = std::pmr::get_default_resource())
+            : upstream { upstream_resource }
+        {
+            allocate_arena(size_bytes);
+        }
+
+        virtual ~arena_resource()
+        {
+            free_overflow();
+            upstream->deallocate(begin, size(), alignment);
+        }
+
+        arena_resource(arena_resource&&) = delete;
+        arena_resource(const arena_resource&) = delete;
+        arena_resource& operator=(arena_resource&&) = delete;
+        arena_resource& operator=(const arena_resource&) = delete;
+
+        // Release all memory allocated from this arena.  This is O(1),
+        // unless the arena overflowed since the last reset.
+        void reset()
+        {
+            peak = std::max(peak, used());
+            if (overflow != nullptr) [[unlikely]] grow();
+            pos = begin;
+        }
+
+        // Size of the arena, in bytes.
+        std::size_t size() const noexcept { return end - begin; }
+
+        // Number of bytes allocated since the last reset, including overflow.
+        std::size_t used() const noexcept { return pos - begin + overflow_bytes; }
+
+        // Highest value of used() seen at reset().
+        std::size_t max_used() const noexcept { return peak; }
+
+        std::pmr::memory_resource* upstream_resource() const noexcept { return upstream; }
+
+    protected:
+        [[nodiscard]] virtual void* do_allocate(std::size_t n, std::size_t a) override
+        {
+            const auto p = (reinterpret_cast<std::uintptr_t>(pos) + a - 1) & -a;
+            if (p + n <= reinterpret_cast<std::uintptr_t>(end)) [[likely]]
+            {
+                pos = reinterpret_cast<std::byte*>(p + n);
+                return reinterpret_cast<void*>(p);
+            }
+            return allocate_overflow(n, a);
+        }
+
+        virtual void do_deallocate(void*, std::size_t, std::size_t) noexcept override { }
+
+        virtual bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+        {
+            return this == &other;
+        }
+
+    private:
+        struct overflow_chunk
+        {
+            overflow_chunk* next;
+            std::size_t size, align;
+        };
+
+        static constexpr std::size_t alignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+        void allocate_arena(std::size_t n)
+        {
+            begin = static_cast<std::byte*>(upstream->allocate(n, alignment));
+            end = begin + n;
+            pos = begin;
+        }
+
+        void* allocate_overflow(std::size_t n, std::size_t a)
+        {
+            const auto align = std::max(a, alignof(overflow_chunk));
+            const auto header = (sizeof(overflow_chunk) + align - 1) & -align;
+            auto* const p = static_cast<std::byte*>(upstream->allocate(header + n, align));
+            overflow = new (p) overflow_chunk { overflow, header + n, align };
+            overflow_bytes += n;
+            return p + header;
+        }
+
+        void free_overflow() noexcept
+        {
+            while (overflow != nullptr)
+            {
+                auto* const c = overflow;
+                overflow = c->next;
+                upstream->deallocate(c, c->size, c->align);
+            }
+            overflow_bytes = 0;
+        }
+
+        void grow()
+        {
+            const auto n = used() + used() / 4;
+            auto* const old = begin;
+            const auto old_size = size();
+            free_overflow();
+            allocate_arena(n);
+            upstream->deallocate(old, old_size, alignment);
+        }
+
+        std::pmr::memory_resource* const upstream;
+        std::byte* begin;
+        std::byte* end;
+        std::byte* pos;
+        overflow_chunk* overflow { nullptr };
+        std::size_t overflow_bytes { 0 };
+        std::size_t peak { 0 };
+    };
+
+    namespace detail
+    {
+        // Number of size classes in the locked slab allocator, for block
+        // sizes 16, 32, 64 ... 512 bytes.
+        constexpr std::size_t locked_slab_classes = 6;
+    }
+
+    struct locked_slab_stats_t
+    {
+        struct per_class
+        {
+            // Size of each block in this class.
+            std::size_t block_size;
+
+            // Number of pages assigned to this class.  Pages are never
+            // returned to the arena, so (pages * page_size - used *
+            // block_size) is the memory lost to fragmentation.
+            std::size_t pages;
+
+            // Number of blocks currently allocated, and the highest number
+            // allocated at once.
+            std::size_t used, peak;
+        };
+
+        std::array<per_class, detail::locked_slab_classes> size_class;
+
+        // Arena size, and the number of bytes assigned to size classes.
+        std::size_t arena_size, arena_used;
+
+        // Number of small allocations that fell back to the general locked
+        // pool, because the arena was exhausted.
+        std::size_t fallback;
+    };
+
+    // Usage of the locked slab allocator, see config::locked_slab_size.
+    locked_slab_stats_t locked_slab_stats() noexcept;
+
+    struct locked_pool_stats_t
+    {
+        // Current size of the global locked pool, in bytes.
+        std::size_t size;
+
+        // Smallest size of the largest free chunk, since the last refill.
+        std::size_t min_free_chunk;
+
+        // Number of times the pool was grown, and the total number of bytes
+        // added.  Use these to tune config::global_locked_pool_size.
+        std::size_t refills, refill_bytes;
+
+        // Number of allocations that failed with std::bad_alloc.
+        std::size_t failures;
+    };
+
+    // Usage of the global locked pool, see
+    // config::locked_pool_refill_watermark.
+    locked_pool_stats_t locked_pool_stats() noexcept;
+
     // Returns a std::pmr::memory_resource that allocates from the global
     // locked pool, same as 'operator new (jw::locked)'.
     inline auto* global_locked_pool_resource() noexcept
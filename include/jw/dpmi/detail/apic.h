@@ -0,0 +1,75 @@
+/* * * * * * * * * * * * * * * * * * jwdpmi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2026 - 2026 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <bitset>
+#include <array>
+#include <cstdint>
+#include "jwdpmi_config.h"
+
+namespace jw::dpmi::detail
+{
+    // Number of IRQ levels.  Levels 0-15 are ISA IRQs.  With the APIC
+    // backend, levels 16-23 are the remaining IOAPIC inputs (usually PCI),
+    // and levels 24-47 have no physical line and are used for MSI.
+    inline constexpr std::uint8_t irq_count = 48;
+    inline constexpr std::uint8_t first_msi_irq = 24;
+
+    // Local APIC and IOAPIC backend.  When set up, each IRQ that has a
+    // handler installed is routed through the IOAPIC to its own vector,
+    // starting at config::apic_vector_base.  Lines without a handler stay on
+    // the 8259 PIC, which is still connected through virtual wire mode, so
+    // IRQs handled in real mode keep working.
+    struct apic
+    {
+        // Detect the APIC via CPUID and the ACPI MADT table, and map its
+        // registers.  Returns false if no usable APIC was found.
+        static bool setup();
+
+        // Release all APIC mappings.  IRQs are then handled by the PIC only.
+        // Only valid while no IRQ levels are routed.
+        static void disable() noexcept;
+
+        static bool enabled() noexcept { return lapic != nullptr; }
+
+        // Check if this IRQ level is currently handled by the APIC.
+        static bool routed(std::uint8_t irq) noexcept { return is_routed[irq]; }
+
+        static std::uint8_t vector(std::uint8_t irq) noexcept { return config::apic_vector_base + irq; }
+
+        // Direct an IRQ level to its APIC vector, and mask it on the PIC.
+        // The IOAPIC input is left masked.  Throws if this level has no
+        // IOAPIC input and is not an MSI level.
+        static void route(std::uint8_t irq);
+
+        // Return this IRQ level to the PIC.
+        static void unroute(std::uint8_t irq) noexcept;
+
+        // Mask or unmask the IOAPIC input for a routed IRQ level.  Returns
+        // the previous state.  MSI levels can not be masked here, use the
+        // device's own interrupt enable bits instead.
+        static bool mask(std::uint8_t irq, bool masked) noexcept;
+        static bool is_masked(std::uint8_t irq) noexcept;
+
+        // Allocate a free IRQ level for use with MSI.  Throws if none are
+        // available.
+        static std::uint8_t allocate_msi();
+        static void free_msi(std::uint8_t irq) noexcept;
+
+        // Message address for MSI, targeting this CPU.
+        static std::uint32_t msi_address() noexcept;
+
+        // A single EOI register write, no port I/O.
+        static void send_eoi() noexcept { lapic[0xb0 / 4] = 0; }
+
+        static bool in_service(std::uint8_t irq) noexcept
+        {
+            const auto v = vector(irq);
+            return lapic[(0x100 + (v / 32) * 0x10) / 4] & (1ul << (v % 32));
+        }
+
+    private:
+        static inline constinit volatile std::uint32_t* lapic { nullptr };
+        static inline constinit std::bitset<irq_count> is_routed { };
+    };
+}
@@ -24,7 +24,8 @@ namespace jw::dpmi::detail
     {
         no,
         eoi_sent,
-        yes
+        yes,
+        polled      // called outside of an interrupt, no EOI needed
     };
 
     struct interrupt_id_data
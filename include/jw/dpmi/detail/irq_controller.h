@@ -2,7 +2,9 @@
 /*    Copyright (C) 2017 - 2025 J.W. Jagersma, see COPYING.txt for details    */
 
 #pragma once
+#include <array>
 #include <bitset>
+#include <optional>
 #include <atomic>
 #include <jw/function.h>
 #include <jw/io/ioport.h>
@@ -12,11 +14,32 @@
 #include <jw/dpmi/irq_config_flags.h>
 #include <jw/uninitialized_storage.h>
 
+namespace jw::dpmi
+{
+    struct irq_handler_stats_t
+    {
+        // Minimum, maximum and average time spent in this handler, in CPU
+        // cycles.  Use chrono::tsc::to_duration() to convert to nanoseconds.
+        std::uint32_t min, max, avg;
+
+        // Distribution of the above.  Bucket 0 counts durations below 1024
+        // cycles, each next bucket covers twice the range of the previous
+        // one, and the last bucket is open-ended.
+        std::array<std::uint32_t, 16> histogram;
+
+        // Number of times this handler was called, and total time spent.
+        std::uint64_t count, cycles;
+    };
+}
+
 namespace jw::dpmi::detail
 {
     [[gnu::naked, gnu::hot]]
     void irq_entry_point() noexcept;
 
+    [[gnu::naked, gnu::hot]]
+    void fast_irq_entry_point() noexcept;
+
     struct irq_handler_data
     {
         friend struct irq_controller;
@@ -30,6 +53,7 @@ namespace jw::dpmi::detail
 
         irq_level assigned_irq() const { return irq; }
         bool is_enabled() const { return enabled; }
+        irq_handler_stats_t get_stats() const noexcept;
 
         template<typename F>
         void set_func(F&& func)
@@ -37,25 +61,37 @@ namespace jw::dpmi::detail
             call = [this, func = std::make_tuple(std::forward<F>(func))] [[gnu::hot]]
             {
                 if (enabled) [[likely]]
-                    std::get<0>(func)();
+                {
+                    if constexpr (config::collect_irq_stats)
+                    {
+                        const auto t = stats_enter();
+                        std::get<0>(func)();
+                        stats_leave(t);
+                    }
+                    else std::get<0>(func)();
+                }
                 if (next) [[likely]]
                     next->call();
             };
         }
 
     private:
+        [[gnu::hot]] static std::uint64_t stats_enter() noexcept;
+        [[gnu::hot]] void stats_leave(std::uint64_t) noexcept;
 
         function<void(), 4> call;
         const irq_config_flags flags;
-        irq_level irq { 16 };
+        irq_level irq { irq_count };
         bool enabled { false };
         irq_handler_data* next { nullptr };
         irq_handler_data* prev { nullptr };
+        irq_handler_stats_t stats { -1u, 0, 0, { }, 0, 0 };
     };
 
     struct irq_controller
     {
         friend void irq_entry_point() noexcept;
+        friend void fast_irq_entry_point() noexcept;
 
         static void enable (irq_handler_data*);
         static void disable(irq_handler_data*);
@@ -76,6 +112,10 @@ namespace jw::dpmi::detail
             acknowledge(id, id->num);
         }
 
+        // Poll the handlers on lines that were masked by the 'coalesce'
+        // flag.
+        static void poll() noexcept;
+
         static void set_pm_interrupt_vector(int_vector v, far_ptr32 ptr);
         static far_ptr32 get_pm_interrupt_vector(int_vector v);
 
@@ -83,6 +123,7 @@ namespace jw::dpmi::detail
         static int_vector irq_to_vec(irq_level i) noexcept
         {
             static dpmi::version ver { };
+            if (apic::routed(i)) return apic::vector(i);
             return i < 8 ? i + ver.pic_master_base : i - 8 + ver.pic_slave_base;
         }
         static irq_level vec_to_irq(int_vector v) noexcept
@@ -90,6 +131,8 @@ namespace jw::dpmi::detail
             static dpmi::version ver { };
             if (v >= ver.pic_master_base and v < ver.pic_master_base + 8u) return v - ver.pic_master_base;
             if (v >= ver.pic_slave_base and v < ver.pic_slave_base + 8u) return v - ver.pic_slave_base + 8;
+            if (v >= config::apic_vector_base and v < config::apic_vector_base + irq_count)
+                if (const irq_level i = v - config::apic_vector_base; apic::routed(i)) return i;
             return 0xff;
         }
 
@@ -107,6 +150,7 @@ namespace jw::dpmi::detail
 
         static bool in_service(irq_level i) noexcept
         {
+            if (apic::routed(i)) return apic::in_service(i);
             if (i > 8)
             {
                 pic1_cmd.write(0x0B);
@@ -120,7 +164,11 @@ namespace jw::dpmi::detail
 
         static void send_eoi(irq_level i) noexcept
         {
-            if (i < 8)
+            if (apic::routed(i))
+            {
+                apic::send_eoi();
+            }
+            else if (i < 8)
             {
                 pic0_cmd.write(i | 0x60);
             }
@@ -134,7 +182,13 @@ namespace jw::dpmi::detail
         [[gnu::cdecl, gnu::hot]]
         static std::byte* get_stack_ptr() noexcept;
         [[gnu::force_align_arg_pointer, gnu::cdecl, gnu::hot]]
-        static void handle_irq(irq_level) noexcept;
+        static void handle_irq(irq_level, std::uint64_t t_entry) noexcept;
+        [[gnu::force_align_arg_pointer, gnu::cdecl, gnu::hot]]
+        static void handle_fast_irq(irq_level, std::uint64_t t_entry) noexcept;
+
+        void update_entry_point();
+        void count_for_coalescing() noexcept;
+        static irq_level route(irq_level);
 
         irq_controller(irq_level i);
         irq_controller(irq_controller&& m) = delete;
@@ -149,6 +203,15 @@ namespace jw::dpmi::detail
         const irq_level irq;
         const far_ptr32 prev_handler { };
         irq_config_flags flags { };
+        bool fast { false };
+
+        struct realmode_reflector;
+        realmode_reflector* reflector { nullptr };
+
+        std::optional<irq_mask> throttle;
+        std::uint64_t window_start { 0 };
+        std::uint32_t window_cycles { 0 };
+        std::uint32_t window_count { 0 };
 
         struct irq_controller_data;
         static constexpr io::io_port<byte> pic0_cmd { 0x20 };
@@ -182,8 +245,8 @@ namespace jw::dpmi::detail
             allocated[i] = false;
         }
 
-        std::bitset<16> allocated { };
-        std::array<uninitialized_storage<irq_controller>, 16> entries;
+        std::bitset<irq_count> allocated { };
+        std::array<uninitialized_storage<irq_controller>, irq_count> entries;
     };
 
     inline void irq_controller::acknowledge(interrupt_id_data* id, std::uint8_t irq) noexcept
@@ -3,22 +3,95 @@
 
 #pragma once
 #include <array>
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include "jwdpmi_config.h"
 
 namespace jw::dpmi::detail
 {
-    alignas (0x10) inline constinit std::array<std::byte, config::locked_stack_size> locked_stack;
+    inline constexpr std::size_t locked_stack_levels = config::locked_stack_sizes.size();
+    inline constexpr std::uint32_t locked_stack_pattern = 0xdeadbeef;
+
+    struct locked_stack_region
+    {
+        std::uint32_t* bottom;
+        std::uint32_t* top;
+        std::size_t max_used;
+    };
+
+    inline constinit std::array<locked_stack_region, locked_stack_levels> locked_stacks { };
     inline constinit std::uint32_t locked_stack_use_count = 0;
+    inline constinit bool locked_stack_guarded = false;
+
+    // Allocate and lock all regions.  Called once from
+    // setup_exception_handling().
+    void setup_locked_stacks();
 
     [[gnu::no_caller_saved_registers, gnu::cdecl]]
     inline std::byte* get_locked_stack() noexcept
     {
-        // If an IRQ/exception switches away from this stack, and a nested
-        // IRQ/exception occurs, the stack is split in half.  This should be
-        // very unlikely to happen.
-        const auto n = locked_stack_use_count++;
-        return locked_stack.data() + (locked_stack.size() >> n) - 4;
+        // Each nesting level gets its own region.  If all are in use, the
+        // last one is handed out again, which overwrites the frames of the
+        // handler that is using it.  The caller must then check
+        // locked_stack_exhausted() and halt before returning there.
+        const auto n = std::min<std::uint32_t>(locked_stack_use_count++, locked_stack_levels - 1);
+        return reinterpret_cast<std::byte*>(locked_stacks[n].top - 1);
+    }
+
+    // More handlers are nested than there are regions.  Increase the size
+    // of config::locked_stack_sizes if this happens.
+    inline bool locked_stack_exhausted() noexcept
+    {
+        return locked_stack_use_count > locked_stack_levels;
+    }
+
+    // The region currently in use by the innermost handler that switched
+    // stacks.
+    inline std::size_t current_locked_stack() noexcept
+    {
+        return std::min<std::uint32_t>(locked_stack_use_count - 1, locked_stack_levels - 1);
+    }
+
+    // Check the canary at the bottom of each region.  Always passes when
+    // guard pages are in use, as an overflow would have faulted already.
+    // Also fails when all regions were exhausted.
+    inline bool locked_stack_overflow() noexcept
+    {
+        if (locked_stack_exhausted()) return true;
+        if (locked_stack_guarded) return false;
+        for (const auto& r : locked_stacks)
+            if (*r.bottom != locked_stack_pattern) [[unlikely]]
+                return true;
+        return false;
+    }
+
+    // Return the number of bytes used in this region since the last call,
+    // and fill the used part below the current stack pointer with the
+    // pattern again.  Stack frames may contain words that were never
+    // written, so scanning only stops after a run of untouched words.
+    // Interrupts must be disabled.
+    inline std::size_t measure_locked_stack(std::size_t level) noexcept
+    {
+        auto& r = locked_stacks[level];
+        auto* deepest = r.top;
+        unsigned clean = 0;
+        for (auto* p = r.top; p > r.bottom and clean < 16;)
+        {
+            if (*--p == locked_stack_pattern) ++clean;
+            else
+            {
+                clean = 0;
+                deepest = p;
+            }
+        }
+        const std::size_t used = (r.top - deepest) * sizeof(std::uint32_t);
+        r.max_used = std::max(r.max_used, used);
+
+        std::uint32_t* sp;
+        asm ("mov %0, esp" : "=r" (sp));
+        if (deepest < sp and sp <= r.top)
+            std::fill(deepest, sp, locked_stack_pattern);
+        return used;
     }
 }
@@ -39,7 +39,27 @@ namespace jw::dpmi
         // do not provide a status flag to identify themselves as the
         // interrupt source.
         // Only one device per IRQ line may be registered with this flag.
-        fallback_handler = 0b100000
+        fallback_handler = 0b100000,
+
+        // Use a minimal entry path when this is the only handler on its IRQ
+        // line.  The handler is called directly with interrupts disabled,
+        // and EOI is sent as soon as it returns.  There is no chaining, no
+        // FPU state is saved, and the handler must not throw.  Has no effect
+        // if other handlers share the line, on IRQ 7 and 15 (which need the
+        // spurious interrupt check), or with always_chain, fallback_handler
+        // or coalesce.
+        fast_irq = 0b1000000,
+
+        // Mask the IRQ line when it fires more than
+        // config::irq_coalesce_threshold times within
+        // config::irq_coalesce_window_us microseconds.  While masked, the
+        // handlers are polled from yield() and after the next outermost
+        // interrupt.  The line is unmasked again as soon as a poll finds no
+        // handler that calls acknowledge().  Handlers must check their
+        // device status before acknowledging.  Requires a calibrated TSC
+        // (see chrono::tsc::setup()), otherwise this has no effect.  Not
+        // supported on MSI levels, enabling such a handler throws.
+        coalesce = 0b10000000
     };
     inline constexpr irq_config_flags operator| (irq_config_flags a, auto b) { return static_cast<irq_config_flags>(static_cast<int>(a) | static_cast<int>(b)); }
     inline constexpr irq_config_flags operator|= (irq_config_flags& a, auto b) { return a = (a | b); }
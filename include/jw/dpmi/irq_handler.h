@@ -4,6 +4,7 @@
 #pragma once
 #include <jw/dpmi/detail/irq_controller.h>
 #include <jw/dpmi/irq_config_flags.h>
+#include <jw/dpmi/detail/stack.h>
 #include <jw/common.h>
 #include <array>
 
@@ -49,6 +50,10 @@ namespace jw::dpmi
         void disable() { detail::irq_controller::disable(data.get()); }
         bool enabled() const noexcept { return data->is_enabled(); }
 
+        // Timing statistics for this handler only.  Collected if
+        // config::collect_irq_stats is enabled.
+        irq_handler_stats_t stats() const noexcept { return data->get_stats(); }
+
         // Call this from your interrupt handler to signal that the IRQ has been successfully handled.
         static void acknowledge() noexcept { detail::irq_controller::acknowledge(); }
 
@@ -77,10 +82,29 @@ namespace jw::dpmi
             // Average duration of the last 32 interrupts, in CPU cycles.
             std::uint32_t avg;
 
+            // Distribution of the time spent in this interrupt handler.
+            // Bucket 0 counts durations below 1024 cycles, each next bucket
+            // covers twice the range of the previous one, and the last
+            // bucket is open-ended.
+            std::array<std::uint32_t, 16> histogram;
+
+            // Maximum entry latency and its distribution, bucketed as above.
+            // This is measured from the entry stub to the first handler
+            // call, and includes switching stacks, saving FPU state and
+            // sending EOI.  The delay between the device raising its IRQ
+            // line and the CPU taking the interrupt can not be measured.
+            std::uint32_t max_latency;
+            std::array<std::uint32_t, 16> latency_histogram;
+
+            // Highest amount of locked stack used by this IRQ, in bytes.
+            // This includes nested interrupts and deferred functions.  Only
+            // collected with config::collect_irq_stack_usage.
+            std::size_t stack_used;
+
             // Number of times this interrupt was triggered.
             std::uint64_t count;
         };
-        std::array<per_irq, 16> irq;
+        std::array<per_irq, detail::irq_count> irq;
 
         // Number of spurious interrupts (only collected if IRQ 7 or 15 are
         // hooked).
@@ -88,4 +112,71 @@ namespace jw::dpmi
     };
 
     irq_stats_t irq_stats() noexcept;
+
+    struct locked_stack_stats_t
+    {
+        // Size of this region, and the most bytes used in it, as measured
+        // after each outermost IRQ.
+        std::size_t size, used;
+    };
+
+    // Usage of each locked stack region, see config::locked_stack_sizes.
+    // Collected if config::collect_irq_stack_usage is enabled.
+    std::array<locked_stack_stats_t, detail::locked_stack_levels> locked_stack_stats() noexcept;
+
+    struct interrupt_mask_stats_t
+    {
+        // Maximum time interrupts were disabled by an interrupt_mask, in CPU
+        // cycles.
+        std::uint32_t max;
+
+        // Distribution of the above, bucketed as in irq_stats_t.
+        std::array<std::uint32_t, 16> histogram;
+
+        // Number of measured interrupt_mask sections.  Only the outermost
+        // interrupt_mask is counted, and only if interrupts were enabled
+        // before.
+        std::uint64_t count;
+    };
+
+    // Collected if config::collect_interrupt_mask_stats is enabled.
+    interrupt_mask_stats_t interrupt_mask_stats() noexcept;
+
+    // Queue a function to be called after the outermost interrupt handler
+    // returns, or at the next yield().  Use this to keep the interrupt
+    // handler itself short.  The function runs with interrupts enabled and
+    // may still interrupt any thread, so it is subject to the same
+    // restrictions as an interrupt handler.  If the queue is full, the
+    // function is called immediately.
+    void defer(function<void(), 4>&&);
+
+    struct deferred_stats_t
+    {
+        // Minimum and maximum time spent in a deferred function, in CPU
+        // cycles.
+        std::uint32_t min, max;
+
+        // Average duration of the last 32 deferred functions, in CPU cycles.
+        std::uint32_t avg;
+
+        // Maximum time between defer() and the start of the call, in CPU
+        // cycles.
+        std::uint32_t max_latency;
+
+        // Number of deferred functions called.
+        std::uint64_t count;
+
+        // Number of functions that were called immediately because the queue
+        // was full.
+        std::uint32_t overflow;
+    };
+
+    deferred_stats_t deferred_stats() noexcept;
+}
+
+namespace jw::dpmi::detail
+{
+    // Call all functions queued by defer().  Does nothing if this is
+    // already in progress.
+    void run_deferred();
 }
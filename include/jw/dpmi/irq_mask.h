@@ -8,18 +8,34 @@
 
 #pragma once
 #include <atomic>
+#include <variant>
 #include <jw/io/ioport.h>
 #include <jw/dpmi/dpmi.h>
 #include <jw/dpmi/detail/selectors.h>
+#include <jw/dpmi/detail/apic.h>
 #include "jwdpmi_config.h"
 
 namespace jw::dpmi::detail
 {
+    // Used by interrupt_mask with config::collect_interrupt_mask_stats.
+    std::uint64_t interrupts_off_begin() noexcept;
+    void interrupts_off_end(std::uint64_t) noexcept;
+
     template<bool enable>
     struct interrupt_flag
     {
-        interrupt_flag() noexcept : prev_state { get_and_set() } { }
-        ~interrupt_flag() { restore(); }
+        interrupt_flag() noexcept : prev_state { get_and_set() }
+        {
+            if constexpr (track_time)
+                if (was_enabled()) t_begin = interrupts_off_begin();
+        }
+
+        ~interrupt_flag()
+        {
+            if constexpr (track_time)
+                if (t_begin != 0) interrupts_off_end(t_begin);
+            restore();
+        }
 
         interrupt_flag(const interrupt_flag&) = delete;
         interrupt_flag(interrupt_flag&&) = delete;
@@ -28,6 +44,13 @@ namespace jw::dpmi::detail
 
     private:
         constexpr static bool use_dpmi = config::support_virtual_interrupt_flag;
+        constexpr static bool track_time = config::collect_interrupt_mask_stats and not enable;
+
+        bool was_enabled() const noexcept
+        {
+            if constexpr (use_dpmi) return prev_state & 1;
+            else return prev_state & 0x200;
+        }
 
         static std::uint32_t get_and_set()
         {
@@ -65,6 +88,7 @@ namespace jw::dpmi::detail
         }
 
         const std::uint32_t prev_state;
+        [[no_unique_address]] std::conditional_t<track_time, std::uint64_t, std::monostate> t_begin { };
     };
 }
 
@@ -133,6 +157,7 @@ namespace jw::dpmi
 
     // Masks one specific IRQ.
     // note: involves IO ports, so this may be slower than disabling interrupts altogether
+    // note: IRQs used for MSI can not be masked here
     class irq_mask
     {
     public:
@@ -152,6 +177,10 @@ namespace jw::dpmi
             {
                 m.count.store(c);
             }
+            else if (detail::apic::routed(irq))
+            {
+                detail::apic::mask(irq, false);
+            }
             else
             {
                 auto [mask, port] = mp(irq);
@@ -162,6 +191,7 @@ namespace jw::dpmi
         static bool enabled(irq_level irq) noexcept
         {
             if ((map[irq].count.load() & ~(1UL << 31)) > 0) return false;
+            if (detail::apic::routed(irq)) return detail::apic::is_masked(irq);
 
             auto [mask, port] = mp(irq);
             return port.read() & mask;
@@ -170,13 +200,22 @@ namespace jw::dpmi
     private:
         void cli() noexcept
         {
-            auto [mask, port] = mp(irq);
-            byte current = port.read();
-            port.write(current | mask);
+            bool was_masked;
+            if (detail::apic::routed(irq))
+            {
+                was_masked = detail::apic::mask(irq, true);
+            }
+            else
+            {
+                auto [mask, port] = mp(irq);
+                byte current = port.read();
+                port.write(current | mask);
+                was_masked = (current & mask) != 0;
+            }
 
             auto& m = map[irq];
             auto c = m.count.load();
-            if ((c & ~(1UL << 31)) == 0) c = ((current & mask) != 0) << 31;
+            if ((c & ~(1UL << 31)) == 0) c = std::uint32_t { was_masked } << 31;
             m.count.store(c + 1);
         }
 
@@ -187,6 +226,11 @@ namespace jw::dpmi
             m.count.store(c);
             if (c == 0)
             {
+                if (detail::apic::routed(irq))
+                {
+                    detail::apic::mask(irq, false);
+                    return;
+                }
                 auto [mask, port] = mp(irq);
                 port.write(port.read() & ~mask);
             }
@@ -207,7 +251,7 @@ namespace jw::dpmi
             std::atomic<std::uint32_t> count { 0 };   // MSB is initial state (unset if irq enabled)
             constexpr mask_counter() noexcept { }
         };
-        static inline std::array<mask_counter, 16> map { };
+        static inline std::array<mask_counter, detail::irq_count> map { };
 
         irq_level irq;
     };
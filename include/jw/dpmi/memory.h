@@ -7,6 +7,7 @@
 #include <sys/nearptr.h>
 #include <limits>
 #include <optional>
+#include <span>
 #include <utility>
 #include "jwdpmi_config.h"
 
@@ -426,6 +427,27 @@ namespace jw::dpmi
 
     struct no_alloc_tag { };
 
+    // DPMI 1.0 page attributes, as used by memory_base::get_page_attributes()
+    // and memory_base::set_page_attributes().
+    struct [[gnu::packed]] page_attributes
+    {
+        enum page_type : unsigned
+        {
+            uncommitted,
+            committed,
+            mapped
+        };
+
+        page_type type : 3;
+        bool writable : 1;
+        bool set_accessed_dirty : 1;
+        bool accessed : 1;
+        bool dirty : 1;
+        unsigned : 9;
+    };
+
+    static_assert (sizeof(page_attributes) == 2);
+
     // Silence warning about resize() being hidden in memory_t below.  This is
     // very much intentional.
 #pragma GCC diagnostic push
@@ -491,6 +513,13 @@ namespace jw::dpmi
         std::uint32_t get_handle() const noexcept { return handle; }
         virtual std::ptrdiff_t offset_in_block() const noexcept { return 0; }
 
+        // Read or modify the attributes of consecutive pages, starting at the
+        // given page-aligned offset.  Only works on memory allocated with the
+        // DPMI 1.0 functions.
+        // DPMI 1.0 AX=0506, AX=0507
+        void get_page_attributes(std::size_t offset, std::span<page_attributes> pages) const;
+        void set_page_attributes(std::size_t offset, std::span<const page_attributes> pages);
+
     protected:
         memory_base(no_alloc_tag, const linear_memory& mem) noexcept
             : linear_memory { mem }
@@ -546,6 +575,10 @@ namespace jw::dpmi
         }
 
     protected:
+        device_memory_base(no_alloc_tag, std::size_t num_bytes)
+            : memory_base(no_alloc_tag { }, round_up_to_page_size(num_bytes) + page_size)
+        { }
+
         void allocate(std::uintptr_t physical_address, bool use_dpmi09_alloc);
         virtual bool allocated() const noexcept override { return addr != 0; };
         virtual void deallocate() override;
@@ -563,6 +596,35 @@ namespace jw::dpmi
         static inline bool dpmi10_alloc_supported = true;
     };
 
+    // Physically contiguous memory, for bus-master DMA.  This is allocated
+    // and locked through XMS, which provides the physical address, and then
+    // mapped as device memory.  The physical start address is aligned to
+    // 'alignment', and if 'boundary' is non-zero, the block will not cross
+    // a multiple of it.  Both must be powers of two.
+    // Requires an XMS driver, and a memory manager (if any) that does not
+    // remap extended memory.
+    struct contiguous_memory_base : public device_memory_base
+    {
+        contiguous_memory_base(std::size_t num_bytes, std::size_t alignment = 4096, std::size_t boundary = 0, bool use_dpmi09_alloc = false);
+        virtual ~contiguous_memory_base();
+
+        contiguous_memory_base(const contiguous_memory_base&) = delete;
+        contiguous_memory_base(contiguous_memory_base&&) = delete;
+        contiguous_memory_base& operator=(const contiguous_memory_base&) = delete;
+        contiguous_memory_base& operator=(contiguous_memory_base&&) = delete;
+
+        std::uintptr_t physical_address() const noexcept { return phys_addr; }
+
+    protected:
+        virtual void deallocate() override;
+
+    private:
+        void free_xms() noexcept;
+
+        std::uint16_t xms_handle { 0 };
+        std::uintptr_t phys_addr { 0 };
+    };
+
     struct mapped_dos_memory_base : public memory_base
     {
         mapped_dos_memory_base(std::size_t num_bytes, std::uintptr_t dos_physical_address)
@@ -656,6 +718,7 @@ namespace jw::dpmi
         // Constructor arguments for each memory class:
         // memory(std::size_t num_elements, bool committed = true)
         // device_memory(std::size_t num_elements, std::uintptr_t physical_address, bool use_dpmi09_alloc = false)
+        // contiguous_memory(std::size_t num_elements, std::size_t alignment = 4096, std::size_t boundary = 0, bool use_dpmi09_alloc = false)
         // mapped_dos_memory(std::size_t num_elements, std::uintptr_t dos_physical_address)
         // mapped_dos_memory(std::size_t num_elements, far_ptr16 dos_address)
         // dos_memory(std::size_t num_elements)
@@ -683,6 +746,7 @@ namespace jw::dpmi
 
     template <typename T = std::byte> using memory = memory_t<T, memory_base>;
     template <typename T = std::byte> using device_memory = memory_t<T, device_memory_base>;
+    template <typename T = std::byte> using contiguous_memory = memory_t<T, contiguous_memory_base>;
     template <typename T = std::byte> using mapped_dos_memory = memory_t<T, mapped_dos_memory_base>;
     template <typename T = std::byte> using dos_memory = memory_t<T, dos_memory_base>;
 
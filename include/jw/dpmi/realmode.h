@@ -2,6 +2,8 @@
 /*    Copyright (C) 2017 - 2025 J.W. Jagersma, see COPYING.txt for details    */
 
 #pragma once
+#include <span>
+#include <optional>
 #include <jw/dpmi/memory.h>
 #include <jw/dpmi/irq_handler.h>
 #include <jw/function.h>
@@ -86,6 +88,48 @@ namespace jw
 
         static_assert(sizeof(realmode_registers) == 0x32, "check sizeof struct dpmi::realmode_registers");
 
+        // Queues a number of real-mode interrupt or procedure calls in
+        // conventional memory, and executes them all with a single mode
+        // switch.  Calls are executed in order on the host-provided real-mode
+        // stack, so the sp/ss fields are ignored.  Results are written back
+        // to the queued registers structures, which remain valid until
+        // clear() is called.
+        struct realmode_batch
+        {
+            realmode_batch(std::size_t max_calls = 16);
+
+            // Queue a real-mode interrupt call.
+            realmode_registers& call_int(std::uint8_t interrupt, const realmode_registers& reg = { });
+
+            // Queue a call to a real-mode procedure which returns with RETF.
+            realmode_registers& call_far(far_ptr16 ptr, const realmode_registers& reg = { });
+
+            // Execute all queued calls.
+            void execute();
+
+            // Remove all queued calls.
+            void clear() noexcept { num_calls = 0; }
+
+            realmode_registers& operator[](std::size_t i) const noexcept;
+            std::size_t size() const noexcept { return num_calls; }
+            std::size_t capacity() const noexcept { return max_calls; }
+            bool empty() const noexcept { return num_calls == 0; }
+
+            realmode_batch(realmode_batch&&) = delete;
+            realmode_batch(const realmode_batch&) = delete;
+            realmode_batch& operator=(realmode_batch&&) = delete;
+            realmode_batch& operator=(const realmode_batch&) = delete;
+
+        private:
+            struct entry;
+            entry* push(const realmode_registers&);
+            entry* entries() const noexcept;
+
+            const std::size_t max_calls;
+            std::size_t num_calls { 0 };
+            dos_memory<std::byte> memory;
+        };
+
         // Reference for writing real-mode callback functions:
         // http://www.delorie.com/djgpp/doc/dpmi/ch4.6.html
         struct raw_realmode_callback
@@ -205,6 +249,63 @@ namespace jw
             static void set(std::uint8_t, far_ptr16);
         };
 
+        // Installs a small real-mode IRQ handler which reads bytes from a
+        // device into a ring buffer in conventional memory, so that IRQs
+        // arriving in real mode (eg. during DOS file I/O) do not need a mode
+        // switch.  If a status port is given, the data port is read as long
+        // as (status & status_mask) is non-zero, otherwise it is read once
+        // per IRQ.  EOI is sent to the PIC by the stub.
+        // This is only suitable for devices where reading the data port
+        // clears the interrupt, such as the keyboard controller, or a UART
+        // with only the receive interrupt enabled.  Lines routed through the
+        // APIC are not supported.
+        // There must be no irq_handler for this line.  With a protected-mode
+        // handler installed, the DPMI host would not reflect the IRQ to real
+        // mode, and the stub would never run.  Without one, the host reflects
+        // every IRQ on this line to real mode, so IRQs that arrive in
+        // protected mode now take a mode switch instead.  This only pays off
+        // if the program spends most of its time in real mode, or if no data
+        // may be lost during long real-mode calls.  Otherwise, use an
+        // irq_handler.
+        // A driver is not notified of new data.  It should poll read(), eg.
+        // from its own thread, or wherever it would check its receive queue.
+        // The previous real-mode handler (eg. the BIOS INT 9 keyboard
+        // handler) is not chained to.  The line is unmasked at the PIC.  Both
+        // are restored by the destructor.
+        struct realmode_irq_buffer
+        {
+            // The buffer size must be a power of two, up to 32kB.
+            realmode_irq_buffer(irq_level irq, io::port_num data_port, io::port_num status_port = 0,
+                                std::uint8_t status_mask = 0, std::size_t buffer_size = 256);
+            ~realmode_irq_buffer();
+
+            // Copy out buffered bytes.  Returns the number of bytes read.
+            std::size_t read(std::span<std::byte>) noexcept;
+
+            // Number of bytes waiting in the buffer.
+            std::size_t size() const noexcept;
+
+            // Number of bytes dropped because the buffer was full.
+            std::uint16_t overflows() const noexcept;
+
+            // Number of IRQs handled in real mode.
+            std::uint16_t interrupts() const noexcept;
+
+            realmode_irq_buffer(realmode_irq_buffer&&) = delete;
+            realmode_irq_buffer(const realmode_irq_buffer&) = delete;
+            realmode_irq_buffer& operator=(realmode_irq_buffer&&) = delete;
+            realmode_irq_buffer& operator=(const realmode_irq_buffer&) = delete;
+
+        private:
+            struct header;
+            volatile header* get_header() const noexcept;
+
+            dos_memory<std::byte> memory;
+            std::optional<raw_realmode_interrupt_handler> handler;
+            irq_level irq;
+            bool was_masked;
+        };
+
         // Registers a procedure as real-mode software interrupt handler,
         // using a callback to protected mode.
         // The handler function returns a bool, indicating whether the
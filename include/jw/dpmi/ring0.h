@@ -44,4 +44,27 @@ namespace jw::dpmi
 
         [[gnu::naked]] static void ring0_entry_point();
     };
+
+    // Enables write-combining on a range of physical memory, such as a
+    // linear framebuffer mapped with device_memory, by programming
+    // variable-range MTRRs.  This requires ring 0 access and a CPU with MTRR
+    // support.  If either is unavailable, or there are not enough free MTRRs
+    // to cover the range, nothing is changed and enabled() returns false.
+    // This has no effect where an existing MTRR marks memory uncacheable.
+    // The MTRRs are released again by the destructor.
+    struct write_combining
+    {
+        write_combining(std::uintptr_t physical_address, std::size_t size) noexcept;
+        ~write_combining();
+
+        write_combining(write_combining&&) = delete;
+        write_combining(const write_combining&) = delete;
+        write_combining& operator=(write_combining&&) = delete;
+        write_combining& operator=(const write_combining&) = delete;
+
+        bool enabled() const noexcept { return mtrrs != 0; }
+
+    private:
+        std::uint32_t mtrrs { 0 };
+    };
 }
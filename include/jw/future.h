@@ -34,6 +34,8 @@ namespace jw::detail
             if (has_result()) throw std::future_error { std::future_errc::promise_already_satisfied };
             new (&value) T { std::forward<U>(v) };
             i = index::value;
+            waiters.notify_all();
+            if (on_ready != nullptr) on_ready(on_ready_arg);
         }
 
         template<typename U>
@@ -42,6 +44,8 @@ namespace jw::detail
             if (has_result()) throw std::future_error { std::future_errc::promise_already_satisfied };
             new (&exception) std::exception_ptr { std::forward<U>(v) };
             i = index::exception;
+            waiters.notify_all();
+            if (on_ready != nullptr) on_ready(on_ready_arg);
         }
 
         void make_ready() noexcept { ready.store(true, std::memory_order_relaxed); }
@@ -60,6 +64,13 @@ namespace jw::detail
             return (value);
         }
 
+        wait_queue waiters;
+
+        // Called after a result is set, to wake an executor where a task is
+        // waiting on this.
+        void (*on_ready)(void*) { nullptr };
+        void* on_ready_arg { nullptr };
+
         promise_result_base() noexcept { };
 
         ~promise_result_base()
@@ -104,23 +115,26 @@ namespace jw::detail
 
         bool valid() const noexcept { return static_cast<bool>(shared_state); }
 
+        // Non-blocking check if a result is available.
+        bool is_ready() const { return state()->has_result(); }
+
         void wait() const
         {
-            this_thread::yield_while([s = state()] { return not s->has_result(); });
+            auto* const s = state();
+            s->waiters.wait_while([s] { return not s->has_result(); });
         };
 
         template<class Rep, class Period>
         std::future_status wait_for(const std::chrono::duration<Rep, Period>& rel_time) const
         {
-            auto timeout = this_thread::yield_while_for([s = state()] { return not s->has_result(); }, rel_time);
-            if (timeout) return std::future_status::timeout;
-            return std::future_status::ready;
+            return wait_until(config::thread_clock::now() + rel_time);
         }
 
         template<class Clock, class Duration>
         std::future_status wait_until(const std::chrono::time_point<Clock, Duration>& abs_time) const
         {
-            auto timeout = this_thread::yield_while_until([s = state()] { return not s->has_result(); }, abs_time);
+            auto* const s = state();
+            auto timeout = s->waiters.wait_while_until([s] { return not s->has_result(); }, abs_time);
             if (timeout) return std::future_status::timeout;
             return std::future_status::ready;
         }
@@ -175,7 +189,18 @@ namespace jw::detail
 
         shared_future<R> share() noexcept;
 
+        // Call f(arg) when the result is set, possibly from an interrupt
+        // handler.  Replaces any previous callback.  Pass nullptr to remove.
+        void set_ready_callback(void (*f)(void*), void* arg)
+        {
+            auto* const s = this->state();
+            dpmi::interrupt_mask no_interrupts_please { };
+            s->on_ready = f;
+            s->on_ready_arg = arg;
+        }
+
         using base::valid;
+        using base::is_ready;
         using base::wait;
         using base::wait_for;
         using base::wait_until;
@@ -214,6 +239,7 @@ namespace jw::detail
         shared_future_base(future_base<R>&& f) noexcept : base { std::move(f.move_state()) } { }
 
         using base::valid;
+        using base::is_ready;
         using base::wait;
         using base::wait_for;
         using base::wait_until;
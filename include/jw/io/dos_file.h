@@ -0,0 +1,112 @@
+/* * * * * * * * * * * * * * * * * * jwdpmi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2017 - 2026 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <jw/io/io_error.h>
+#include <jw/dpmi/memory.h>
+#include <jw/thread.h>
+#include <jw/mutex.h>
+#include <jw/condition_variable.h>
+#include <jw/common.h>
+#include <span>
+#include <memory>
+#include <vector>
+#include <exception>
+
+namespace jw::io
+{
+    struct dos_error : io_error
+    {
+        dos_error(std::uint16_t c, const char* msg) : io_error { msg }, code { c } { }
+
+        // DOS error code, as returned in AX.
+        const std::uint16_t code;
+    };
+
+    struct dos_file_config
+    {
+        // Size of each transfer buffer in conventional memory.  Must be less
+        // than 64kB.
+        std::size_t buffer_size { 32_KB };
+
+        // Number of transfer buffers.  With read-ahead enabled, at least two
+        // are needed to have any effect.
+        std::size_t num_buffers { 2 };
+
+        // Fill the next buffers from a background thread, while the current
+        // one is being processed.  This only helps if the reading thread
+        // yields in between calls to read().
+        bool read_ahead { true };
+    };
+
+    // Read-only file access through DOS, reading directly into conventional
+    // memory buffers.  Unlike libc file I/O, this does not go through the
+    // small transfer buffer, and data can be accessed without copying.
+    // Transfer buffers are taken from a pool, and returned to it when the
+    // file is closed, so that conventional memory is not fragmented by
+    // repeatedly opening files.
+    struct dos_file
+    {
+        dos_file(const char* filename, const dos_file_config& cfg = { });
+        ~dos_file();
+
+        dos_file(dos_file&&) = delete;
+        dos_file(const dos_file&) = delete;
+        dos_file& operator=(dos_file&&) = delete;
+        dos_file& operator=(const dos_file&) = delete;
+
+        // Returns the next chunk of the file, which is at most buffer_size
+        // bytes.  This points directly into conventional memory, and remains
+        // valid until the next call to read(), seek(), or the destructor.
+        // An empty span is returned at end of file.
+        std::span<const std::byte> read();
+
+        // Copy the next bytes from the file into the given buffer.  Returns
+        // the number of bytes copied, which is only less than requested at
+        // end of file.
+        std::size_t read(std::span<std::byte>);
+
+        // Set the read position, and discard any buffered data.
+        void seek(std::uint32_t pos);
+
+        // Current read position.
+        std::uint32_t tell() const noexcept { return pos; }
+
+        // File size.
+        std::uint32_t size() const noexcept { return file_size; }
+
+        bool eof() const noexcept { return pos >= file_size; }
+
+        // Free all transfer buffers that are not in use by any open file.
+        static void free_buffers() noexcept;
+
+    private:
+        struct buffer
+        {
+            std::unique_ptr<dpmi::dos_memory<std::byte>> memory;
+            std::size_t size;
+        };
+
+        void fill();
+        bool next();
+        void release_current() noexcept;
+        void set_file_pointer(std::uint32_t);
+        void read_ahead_thread(std::stop_token);
+
+        std::uint16_t handle;
+        std::uint32_t file_size;
+        std::uint32_t pos { 0 };
+        std::uint32_t fill_pos { 0 };
+        std::vector<buffer> buffers;
+        std::size_t read_index { 0 };
+        std::size_t num_full { 0 };
+        bool have_current { false };
+        std::span<const std::byte> current { };
+        std::exception_ptr error { };
+        // Held while the buffer state is changed, and during DOS calls.
+        jw::mutex mutex;
+        // Notifies the read-ahead thread that a buffer was released.
+        jw::condition_variable released;
+        jthread thread;
+    };
+}
@@ -5,6 +5,7 @@
 #include <initializer_list>
 #include <stdexcept>
 #include <jw/io/ioport.h>
+#include <jw/dpmi/irq_mask.h>
 #include <jw/common.h>
 
 namespace jw::io
@@ -141,8 +142,17 @@ namespace jw::io
             command_and_status().write(r);
         }
 
+        // Enable Message Signaled Interrupts and return the IRQ level to
+        // install a handler on.  This requires the APIC backend.  Legacy
+        // interrupts are disabled while MSI is in use.
+        dpmi::irq_level enable_msi();
+        void disable_msi() noexcept;
+
     private:
+        std::uint8_t find_capability(std::uint8_t id) const noexcept;
+
         std::uint8_t bus, device, function;
+        dpmi::irq_level msi_irq { 0xff };
     };
 
     template <typename T>
@@ -0,0 +1,48 @@
+/* * * * * * * * * * * * * * * * * * jwdpmi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2026 - 2026 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <atomic>
+#include <limits>
+#include <jw/thread.h>
+
+namespace jw
+{
+    // Single-use thread barrier, blocking on the scheduler.  count_down()
+    // may be called from interrupt handlers.
+    class latch
+    {
+    public:
+        static constexpr std::ptrdiff_t max() noexcept { return std::numeric_limits<std::ptrdiff_t>::max(); }
+
+        constexpr explicit latch(std::ptrdiff_t expected) noexcept : counter { expected } { }
+
+        latch(latch&&) = delete;
+        latch(const latch&) = delete;
+        latch& operator=(latch&&) = delete;
+        latch& operator=(const latch&) = delete;
+
+        void count_down(std::ptrdiff_t n = 1) noexcept
+        {
+            if (counter.fetch_sub(n, std::memory_order_release) == n)
+                waiters.notify_all();
+        }
+
+        bool try_wait() const noexcept { return counter.load(std::memory_order_acquire) == 0; }
+
+        void wait() const
+        {
+            waiters.wait_while([this] { return not try_wait(); });
+        }
+
+        void arrive_and_wait(std::ptrdiff_t n = 1)
+        {
+            count_down(n);
+            wait();
+        }
+
+    private:
+        std::atomic<std::ptrdiff_t> counter;
+        mutable detail::wait_queue waiters;
+    };
+}
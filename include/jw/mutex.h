@@ -19,6 +19,10 @@ namespace jw
     class mutex
     {
         std::atomic_flag locked { false };
+
+    protected:
+        detail::wait_queue waiters;
+
     public:
         constexpr mutex() noexcept = default;
         mutex(mutex&&) = delete;
@@ -31,11 +35,12 @@ namespace jw
                 if (try_lock()) return;
                 else throw deadlock { };
             }
-            this_thread::yield_while([this]() { return not try_lock(); });
+            waiters.wait_while([this]() { return not try_lock(); });
         }
         void unlock() noexcept
         {
             locked.clear();
+            waiters.notify_one();
         }
         bool try_lock() noexcept
         {
@@ -57,6 +62,9 @@ namespace jw
             bool operator()(const std::nullptr_t&) const noexcept { return false; }
         };
 
+    protected:
+        detail::wait_queue waiters;
+
     public:
         constexpr recursive_mutex() noexcept = default;
         recursive_mutex(recursive_mutex&&) = delete;
@@ -69,12 +77,16 @@ namespace jw
                 if (try_lock()) return;
                 else throw deadlock { };
             }
-            this_thread::yield_while([this]() { return not try_lock(); });
+            waiters.wait_while([this]() { return not try_lock(); });
         }
 
         void unlock() noexcept
         {
-            if (--lock_count == 0) owner = nullptr;
+            if (--lock_count == 0)
+            {
+                owner = nullptr;
+                waiters.notify_one();
+            }
         }
 
         bool try_lock() noexcept
@@ -0,0 +1,71 @@
+/* * * * * * * * * * * * * * * * * * jwdpmi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2026 - 2026 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <atomic>
+#include <limits>
+#include <jw/thread.h>
+#include "jwdpmi_config.h"
+
+namespace jw
+{
+    // Counting semaphore, blocking on the scheduler.  release() may be called
+    // from interrupt handlers, to wake up a consumer thread without polling.
+    template<std::ptrdiff_t LeastMaxValue = std::numeric_limits<std::ptrdiff_t>::max()>
+    class counting_semaphore
+    {
+    public:
+        static constexpr std::ptrdiff_t max() noexcept { return LeastMaxValue; }
+
+        constexpr explicit counting_semaphore(std::ptrdiff_t desired) noexcept : count { desired } { }
+
+        counting_semaphore(counting_semaphore&&) = delete;
+        counting_semaphore(const counting_semaphore&) = delete;
+        counting_semaphore& operator=(counting_semaphore&&) = delete;
+        counting_semaphore& operator=(const counting_semaphore&) = delete;
+
+        void release(std::ptrdiff_t update = 1) noexcept
+        {
+            count.fetch_add(update, std::memory_order_release);
+            while (update-- > 0 and not waiters.empty())
+                waiters.notify_one();
+        }
+
+        void acquire()
+        {
+            if (dpmi::in_irq_context())
+            {
+                if (try_acquire()) return;
+                else throw deadlock { };
+            }
+            waiters.wait_while([this] { return not try_acquire(); });
+        }
+
+        bool try_acquire() noexcept
+        {
+            auto c = count.load(std::memory_order_relaxed);
+            while (c > 0)
+                if (count.compare_exchange_weak(c, c - 1, std::memory_order_acquire, std::memory_order_relaxed))
+                    return true;
+            return false;
+        }
+
+        template<class Rep, class Period>
+        bool try_acquire_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_acquire_until(config::thread_clock::now() + rel_time);
+        }
+
+        template<class Clock, class Duration>
+        bool try_acquire_until(const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return not waiters.wait_while_until([this] { return not try_acquire(); }, abs_time);
+        }
+
+    private:
+        std::atomic<std::ptrdiff_t> count;
+        detail::wait_queue waiters;
+    };
+
+    using binary_semaphore = counting_semaphore<1>;
+}
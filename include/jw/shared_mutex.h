@@ -14,6 +14,9 @@ namespace jw
         std::atomic_flag locked { false };
         std::atomic<std::uint32_t> shared_count { 0 };
 
+    protected:
+        detail::wait_queue waiters;
+
     public:
         constexpr shared_mutex() noexcept = default;
         shared_mutex(shared_mutex&&) = delete;
@@ -26,14 +29,18 @@ namespace jw
                 if (try_lock()) return;
                 else throw deadlock { };
             }
-            this_thread::yield_while([this]() { return not try_lock(); });
+            waiters.wait_while([this]() { return not try_lock(); });
+        }
+        void unlock() noexcept
+        {
+            locked.clear();
+            waiters.notify_all();
         }
-        void unlock() noexcept { locked.clear(); }
         bool try_lock() noexcept
         {
             if (locked.test_and_set()) return false;
             if (shared_count == 0) return true;
-            unlock();
+            locked.clear();
             return false;
         }
 
@@ -44,14 +51,18 @@ namespace jw
                 if (try_lock_shared()) return;
                 else throw deadlock { };
             }
-            this_thread::yield_while([this]() { return not try_lock_shared(); });
+            waiters.wait_while([this]() { return not try_lock_shared(); });
+        }
+        void unlock_shared() noexcept
+        {
+            if (--shared_count == 0)
+                waiters.notify_all();
         }
-        void unlock_shared() noexcept { --shared_count; }
         bool try_lock_shared() noexcept
         {
             if (locked.test_and_set()) return false;
             ++shared_count;
-            unlock();
+            locked.clear();
             return true;
         }
     };
@@ -61,13 +72,13 @@ namespace jw
         template <class Rep, class Period>
         bool try_lock_shared_for(const std::chrono::duration<Rep, Period>& rel_time)
         {
-            return not this_thread::yield_while_for([this] { return not this->try_lock_shared(); }, rel_time);
+            return try_lock_shared_until(config::thread_clock::now() + rel_time);
         }
 
         template <class Clock, class Duration>
         bool try_lock_shared_until(const std::chrono::time_point<Clock, Duration>& abs_time)
         {
-            return not this_thread::yield_while_until([this] { return not this->try_lock_shared(); }, abs_time);
+            return not this->waiters.wait_while_until([this] { return not this->try_lock_shared(); }, abs_time);
         }
     };
 }
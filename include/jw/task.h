@@ -0,0 +1,463 @@
+/* * * * * * * * * * * * * * * * * * jwdpmi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2026 - 2026 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <atomic>
+#include <coroutine>
+#include <optional>
+#include <vector>
+#include <deque>
+#include <streambuf>
+#include <jw/thread.h>
+#include <jw/future.h>
+#include <jw/dpmi/irq_check.h>
+#include "jwdpmi_config.h"
+
+namespace jw
+{
+    template<typename T = void> struct task;
+    struct executor;
+}
+
+namespace jw::detail
+{
+    struct executor_access;
+}
+
+namespace jw::detail
+{
+    struct task_promise_base
+    {
+        struct final_awaiter
+        {
+            bool await_ready() const noexcept { return false; }
+            void await_resume() const noexcept { }
+
+            template<typename P>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) const noexcept
+            {
+                auto c = h.promise().continuation;
+                if (c) return c;
+                return std::noop_coroutine();
+            }
+        };
+
+        std::suspend_always initial_suspend() const noexcept { return { }; }
+        final_awaiter final_suspend() const noexcept { return { }; }
+
+        void unhandled_exception()
+        {
+            try { throw; }
+            catch (const abi::__forced_unwind&) { throw; }
+            catch (...) { exception = std::current_exception(); }
+        }
+
+        void rethrow_if_exception()
+        {
+            if (exception) std::rethrow_exception(std::move(exception));
+        }
+
+        executor* exec { nullptr };
+        std::coroutine_handle<> continuation { };
+        std::exception_ptr exception { };
+    };
+
+    template<typename T>
+    struct task_promise : task_promise_base
+    {
+        task<T> get_return_object() noexcept;
+
+        template<typename U>
+        void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+
+        T result()
+        {
+            rethrow_if_exception();
+            return std::move(*value);
+        }
+
+    private:
+        std::optional<T> value;
+    };
+
+    template<>
+    struct task_promise<void> : task_promise_base
+    {
+        task<void> get_return_object() noexcept;
+        void return_void() const noexcept { }
+        void result() { rethrow_if_exception(); }
+    };
+
+    // Root coroutine created by executor::spawn().  It destroys itself on
+    // completion.
+    struct spawned_task
+    {
+        struct promise_type
+        {
+            spawned_task get_return_object() noexcept { return { std::coroutine_handle<promise_type>::from_promise(*this) }; }
+            std::suspend_always initial_suspend() const noexcept { return { }; }
+            std::suspend_never final_suspend() noexcept;
+            void return_void() const noexcept { }
+            void unhandled_exception() { throw; }
+
+            executor* exec { nullptr };
+            promise_type* prev { nullptr };
+            promise_type* next { nullptr };
+        };
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    // Base for awaitables that are polled by the executor.  A notifying
+    // awaitable calls executor::notify() when it may have become ready, and
+    // is only polled again after a wakeup.  Otherwise, the executor can not
+    // block while it is pending, and polls it on every scheduler round.
+    struct poll_awaiter
+    {
+        bool await_ready() { return poll(); }
+
+        template<typename P>
+        void await_suspend(std::coroutine_handle<P> h);
+
+        virtual bool poll() = 0;
+
+        std::coroutine_handle<> handle;
+        const bool notifying;
+
+    protected:
+        explicit poll_awaiter(bool n) noexcept : notifying { n } { }
+        ~poll_awaiter() = default;
+
+        // Called after this is queued on the executor.
+        virtual void suspended(executor*) { }
+    };
+}
+
+namespace jw
+{
+    // Lazily-started coroutine.  Tasks don't need their own stack, so they
+    // are much cheaper than threads.  A task runs on an executor, and may
+    // co_await other tasks, timers, futures and IRQ events.
+    template<typename T>
+    struct [[nodiscard]] task
+    {
+        using promise_type = detail::task_promise<T>;
+
+        task(task&& other) noexcept : handle { std::exchange(other.handle, nullptr) } { }
+        task& operator=(task&& other) noexcept
+        {
+            std::swap(handle, other.handle);
+            return *this;
+        }
+
+        task(const task&) = delete;
+        task& operator=(const task&) = delete;
+
+        ~task() { if (handle) handle.destroy(); }
+
+        auto operator co_await() && noexcept
+        {
+            struct awaiter
+            {
+                std::coroutine_handle<promise_type> h;
+
+                bool await_ready() const noexcept { return h.done(); }
+                T await_resume() { return h.promise().result(); }
+
+                template<typename P>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<P> c) noexcept
+                {
+                    h.promise().exec = c.promise().exec;
+                    h.promise().continuation = c;
+                    return h;
+                }
+            };
+            return awaiter { handle };
+        }
+
+    private:
+        friend promise_type;
+        explicit task(std::coroutine_handle<promise_type> h) noexcept : handle { h } { }
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    // Runs tasks on a dedicated thread.  When no tasks are runnable, the
+    // thread blocks on the scheduler until the next timer expires or until
+    // notify() is called.
+    struct executor
+    {
+        using clock = config::thread_clock;
+
+        explicit executor(thread_priority priority = thread_priority::normal, std::size_t stack_size = config::thread_default_stack_size)
+            : worker { priority, stack_size, [this](std::stop_token s) { run(s); } } { }
+
+        ~executor();
+
+        executor(executor&&) = delete;
+        executor(const executor&) = delete;
+        executor& operator=(executor&&) = delete;
+        executor& operator=(const executor&) = delete;
+
+        // Start a task on this executor.  The returned future becomes ready
+        // when the task completes.  Pending tasks are destroyed along with
+        // the executor.
+        template<typename T>
+        future<T> spawn(task<T>);
+
+        // Wake up the executor to re-check polled awaitables.  This may be
+        // called from interrupt handlers (if the executor is allocated in
+        // locked memory).
+        void notify() noexcept
+        {
+            notified = true;
+            wake.notify_one();
+        }
+
+    private:
+        friend struct detail::executor_access;
+        friend struct detail::spawned_task::promise_type;
+
+        struct timer
+        {
+            clock::time_point time;
+            std::coroutine_handle<> handle;
+        };
+
+        void run(std::stop_token);
+        void schedule(std::coroutine_handle<> h) { ready.push_back(h); notify(); }
+        void add_timer(clock::time_point, std::coroutine_handle<>);
+        void add_poll(detail::poll_awaiter* p) { polling.push_back(p); }
+
+        std::deque<std::coroutine_handle<>> ready;
+        std::vector<timer> timers;
+        std::vector<detail::poll_awaiter*> polling;
+        detail::spawned_task::promise_type* roots { nullptr };
+        detail::wait_queue wake;
+        volatile bool notified { false };
+        jthread worker;
+    };
+
+}
+
+namespace jw::detail
+{
+    struct executor_access
+    {
+        static void schedule(executor* e, std::coroutine_handle<> h) { e->schedule(h); }
+        static void add_timer(executor* e, executor::clock::time_point t, std::coroutine_handle<> h) { e->add_timer(t, h); }
+        static void add_poll(executor* e, poll_awaiter* p) { e->add_poll(p); }
+    };
+}
+
+namespace jw
+{
+    // Event that is signaled from an interrupt handler, and awaited in a
+    // task.  Each call to signal() resumes one co_await.
+    struct irq_event
+    {
+        explicit irq_event(executor& e) noexcept : exec { &e } { }
+
+        void signal() noexcept
+        {
+            count.fetch_add(1, std::memory_order_release);
+            exec->notify();
+        }
+
+        auto operator co_await() noexcept
+        {
+            struct awaiter final : detail::poll_awaiter
+            {
+                irq_event* self;
+                awaiter(irq_event* e) : poll_awaiter { true }, self { e } { }
+                void await_resume() const noexcept { }
+                virtual bool poll() override { return self->try_consume(); }
+            };
+            return awaiter { this };
+        }
+
+    private:
+        bool try_consume() noexcept
+        {
+            auto c = count.load(std::memory_order_relaxed);
+            while (c > 0)
+                if (count.compare_exchange_weak(c, c - 1, std::memory_order_acquire, std::memory_order_relaxed))
+                    return true;
+            return false;
+        }
+
+        std::atomic<std::uint32_t> count { 0 };
+        executor* const exec;
+    };
+
+    template<typename R>
+    auto operator co_await(future<R>& f)
+    {
+        struct awaiter final : detail::poll_awaiter
+        {
+            future<R>* f;
+            bool registered { false };
+            awaiter(future<R>* p) : poll_awaiter { true }, f { p } { }
+            ~awaiter() { unregister(); }
+
+            decltype(auto) await_resume()
+            {
+                unregister();
+                return f->get();
+            }
+
+            virtual bool poll() override { return f->is_ready(); }
+
+            virtual void suspended(executor* e) override
+            {
+                f->set_ready_callback([](void* p) { static_cast<executor*>(p)->notify(); }, e);
+                registered = true;
+                if (f->is_ready()) e->notify();
+            }
+
+            void unregister()
+            {
+                if (registered and f->valid()) f->set_ready_callback(nullptr, nullptr);
+                registered = false;
+            }
+        };
+        return awaiter { &f };
+    }
+
+    template<typename R>
+    auto operator co_await(future<R>&& f) { return operator co_await(f); }
+}
+
+namespace jw::this_task
+{
+    // Reschedule the current task after all other runnable tasks.
+    inline auto yield()
+    {
+        struct awaiter
+        {
+            bool await_ready() const noexcept { return false; }
+            void await_resume() const noexcept { }
+
+            template<typename P>
+            void await_suspend(std::coroutine_handle<P> h) { detail::executor_access::schedule(h.promise().exec, h); }
+        };
+        return awaiter { };
+    }
+
+    // Suspend the current task until the given time point.
+    template<typename P>
+    inline auto sleep_until(const P& time_point)
+    {
+        using clock = executor::clock;
+        struct awaiter
+        {
+            clock::time_point time;
+
+            bool await_ready() const { return clock::now() >= time; }
+            void await_resume() const noexcept { }
+
+            template<typename Q>
+            void await_suspend(std::coroutine_handle<Q> h) { detail::executor_access::add_timer(h.promise().exec, time, h); }
+        };
+
+        if constexpr (std::is_same_v<typename P::clock, clock>)
+            return awaiter { std::chrono::time_point_cast<clock::duration>(time_point) };
+        else
+            return awaiter { clock::now() + std::chrono::ceil<clock::duration>(time_point - P::clock::now()) };
+    }
+
+    // Suspend the current task for the given duration.
+    template<typename Rep, typename Period>
+    inline auto sleep_for(const std::chrono::duration<Rep, Period>& duration)
+    {
+        return sleep_until(executor::clock::now() + std::chrono::ceil<executor::clock::duration>(duration));
+    }
+
+    // Suspend the current task while the given condition evaluates to true.
+    // The condition can't wake up the executor, so while this is pending,
+    // the executor thread never blocks, and polls every pending awaitable on
+    // each scheduler round.  Prefer irq_event or a future where possible.
+    template<typename F>
+    inline auto yield_while(F&& condition)
+    {
+        struct awaiter final : detail::poll_awaiter
+        {
+            std::remove_cvref_t<F> condition;
+            awaiter(F&& f) : poll_awaiter { false }, condition { std::forward<F>(f) } { }
+            void await_resume() const noexcept { }
+            virtual bool poll() override { return not condition(); }
+        };
+        return awaiter { std::forward<F>(condition) };
+    }
+
+    // Suspend the current task until data is available on the given stream
+    // buffer, eg. from an rs232_stream or mpu401_stream.  This is polled,
+    // see yield_while().
+    inline auto readable(std::streambuf& buf)
+    {
+        return yield_while([&buf] { return buf.in_avail() == 0; });
+    }
+}
+
+namespace jw::detail
+{
+    template<typename T>
+    inline task<T> task_promise<T>::get_return_object() noexcept
+    {
+        return task<T> { std::coroutine_handle<task_promise>::from_promise(*this) };
+    }
+
+    inline task<void> task_promise<void>::get_return_object() noexcept
+    {
+        return task<void> { std::coroutine_handle<task_promise>::from_promise(*this) };
+    }
+
+    template<typename P>
+    inline void poll_awaiter::await_suspend(std::coroutine_handle<P> h)
+    {
+        handle = h;
+        executor_access::add_poll(h.promise().exec, this);
+        suspended(h.promise().exec);
+    }
+
+    inline std::suspend_never spawned_task::promise_type::final_suspend() noexcept
+    {
+        if (prev != nullptr) prev->next = next;
+        else exec->roots = next;
+        if (next != nullptr) next->prev = prev;
+        return { };
+    }
+}
+
+namespace jw
+{
+    template<typename T>
+    inline future<T> executor::spawn(task<T> t)
+    {
+        dpmi::throw_if_irq();
+        promise<T> p { };
+        auto f = p.get_future();
+        auto s = [](task<T> t, promise<T> p) -> detail::spawned_task
+        {
+            try
+            {
+                if constexpr (std::is_void_v<T>)
+                {
+                    co_await std::move(t);
+                    p.set_value();
+                }
+                else p.set_value(co_await std::move(t));
+            }
+            catch (const abi::__forced_unwind&) { throw; }
+            catch (...) { p.set_exception(std::current_exception()); }
+        } (std::move(t), std::move(p));
+
+        auto& root = s.handle.promise();
+        root.exec = this;
+        root.next = roots;
+        if (roots != nullptr) roots->prev = &root;
+        roots = &root;
+        schedule(s.handle);
+        return f;
+    }
+}
@@ -6,6 +6,7 @@
 #include <stop_token>
 #include <concepts>
 #include <jw/detail/scheduler.h>
+#include <jw/chrono.h>
 #include <jw/main.h>
 #include "jwdpmi_config.h"
 
@@ -28,7 +29,11 @@ namespace jw
 
         template<typename F, typename... A> requires std::invocable<std::decay_t<F>, std::decay_t<A>...>
         explicit thread(std::size_t stack_size, F&& f, A&&... args)
-            : ptr { create(stack_size, std::forward<F>(f), std::forward<A>(args)...) } { }
+            : thread { thread_priority::normal, stack_size, std::forward<F>(f), std::forward<A>(args)... } { }
+
+        template<typename F, typename... A> requires std::invocable<std::decay_t<F>, std::decay_t<A>...>
+        explicit thread(thread_priority priority, std::size_t stack_size, F&& f, A&&... args)
+            : ptr { create(priority, stack_size, std::forward<F>(f), std::forward<A>(args)...) } { }
 
         ~thread() noexcept(false) { if (ptr) terminate(); }
 
@@ -53,6 +58,13 @@ namespace jw
         void cancel() { ptr->cancel(); };
         [[nodiscard]] bool active() const noexcept { return ptr and ptr->active(); }
 
+        void priority(thread_priority p) { ptr->set_priority(p); }
+        [[nodiscard]] thread_priority priority() const noexcept { return ptr->get_priority(); }
+
+        // Run time and scheduling statistics for this thread.  Only
+        // collected if config::collect_thread_stats is enabled.
+        [[nodiscard]] thread_stats_t stats() const noexcept { return ptr->get_stats(); }
+
         template<typename F>
         void invoke(F&& func) { ptr->invoke(std::forward<F>(func)); }
 
@@ -64,7 +76,7 @@ namespace jw
 
     private:
         template<typename F, typename... A>
-        detail::thread* create(std::size_t, F&&, A&&...);
+        detail::thread* create(thread_priority, std::size_t, F&&, A&&...);
 
         detail::thread* ptr;
     };
@@ -86,7 +98,11 @@ namespace jw
 
         template<typename F, typename... A>
         explicit jthread(std::size_t stack_size, F&& f, A&&... args)
-            : stop { }, t { create(stop, stack_size, std::forward<F>(f), std::forward<A>(args)...) } { }
+            : jthread { thread_priority::normal, stack_size, std::forward<F>(f), std::forward<A>(args)... } { }
+
+        template<typename F, typename... A>
+        explicit jthread(thread_priority priority, std::size_t stack_size, F&& f, A&&... args)
+            : stop { }, t { create(stop, priority, stack_size, std::forward<F>(f), std::forward<A>(args)...) } { }
 
         ~jthread() { if (joinable()) { request_stop(); join(); } }
 
@@ -109,6 +125,10 @@ namespace jw
         void cancel() { return t.cancel(); };
         [[nodiscard]] bool active() const noexcept { return t.active(); }
 
+        void priority(thread_priority p) { t.priority(p); }
+        [[nodiscard]] thread_priority priority() const noexcept { return t.priority(); }
+        [[nodiscard]] thread_stats_t stats() const noexcept { return t.stats(); }
+
         template<typename F>
         void invoke(F&& func) { t.invoke(std::forward<F>(func)); }
 
@@ -124,7 +144,7 @@ namespace jw
 
     private:
         template<typename F, typename... A>
-        thread create(std::stop_source&, std::size_t, F&&, A&&...);
+        thread create(std::stop_source&, thread_priority, std::size_t, F&&, A&&...);
 
         std::stop_source stop;
         thread t;
@@ -137,6 +157,10 @@ namespace jw::this_thread
 {
     inline jw::thread::id get_id() noexcept { return detail::scheduler::current_thread_id(); }
 
+    inline thread_priority get_priority() noexcept { return detail::scheduler::current_thread()->get_priority(); }
+    inline void set_priority(thread_priority p) noexcept { detail::scheduler::current_thread()->set_priority(p); }
+    inline thread_stats_t stats() noexcept { return detail::scheduler::current_thread()->get_stats(); }
+
     // Yields execution to the next thread in the queue.
     inline void yield()
     {
@@ -150,11 +174,21 @@ namespace jw::this_thread
         while (condition()) yield();
     }
 
-    // Yields execution until the given time point.
+    // Yields execution until the given time point.  If the TSC is
+    // calibrated, the thread is placed on the scheduler's sleep queue and
+    // will not be rescheduled until the deadline passes.
     template<typename P>
     inline void yield_until(const P& time_point)
     {
-        yield_while([&time_point] { return P::clock::now() < time_point; });
+        while (true)
+        {
+            const auto now = P::clock::now();
+            if (now >= time_point) return;
+            const auto dt = std::chrono::ceil<chrono::tsc::duration>(time_point - now);
+            const auto ticks = chrono::tsc::to_count(dt);
+            if (ticks > 0) detail::scheduler::sleep_until(chrono::rdtsc() + ticks);
+            else yield();
+        }
     }
 
     // Yields execution for the given duration.
@@ -207,25 +241,23 @@ namespace jw
     {
         if (not ptr) throw std::system_error { std::make_error_code(std::errc::no_such_process) };
         if (get_id() == detail::scheduler::current_thread_id()) throw deadlock { };
-        auto id = ptr->id;
-        ptr->resume();
-        detach();
-        this_thread::yield_while([id] { return detail::scheduler::get_thread(id) != nullptr; });
+        finally do_detach { [this] { detach(); } };
+        ptr->join();
     }
 
     template<typename F, typename... A>
-    inline detail::thread* thread::create(std::size_t stack_size, F&& func, A&&... args)
+    inline detail::thread* thread::create(thread_priority priority, std::size_t stack_size, F&& func, A&&... args)
     {
         auto wrapper = callable_tuple { std::forward<F>(func), std::forward<A>(args)... };
-        return detail::scheduler::create_thread(std::move(wrapper), stack_size);
+        return detail::scheduler::create_thread(std::move(wrapper), stack_size, priority);
     }
 
     template<typename F, typename... A>
-    inline thread jthread::create(std::stop_source& s, std::size_t stack_size, F&& func, A&&... args)
+    inline thread jthread::create(std::stop_source& s, thread_priority priority, std::size_t stack_size, F&& func, A&&... args)
     {
         if constexpr (std::is_invocable_v<std::decay_t<F>, std::stop_token, std::decay_t<A>...>)
-            return thread { stack_size, std::forward<F>(func), s.get_token(), std::forward<A>(args)... };
+            return thread { priority, stack_size, std::forward<F>(func), s.get_token(), std::forward<A>(args)... };
         else
-            return thread { stack_size, std::forward<F>(func), std::forward<A>(args)... };
+            return thread { priority, stack_size, std::forward<F>(func), std::forward<A>(args)... };
     }
 }
@@ -0,0 +1,155 @@
+/* * * * * * * * * * * * * * * * * * jwdpmi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2026 - 2026 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <deque>
+#include <memory>
+#include <ranges>
+#include <vector>
+#include <jw/thread.h>
+#include <jw/future.h>
+#include <jw/function.h>
+#include "jwdpmi_config.h"
+
+namespace jw
+{
+    // Fixed set of worker threads that run queued jobs.  This avoids
+    // creating a new thread, and allocating its stack, for each short-lived
+    // piece of work.  Jobs are started in the order they were queued.
+    struct thread_pool
+    {
+        using job = jw::function<void(), 4>;
+
+        explicit thread_pool(std::size_t num_threads, std::size_t stack_size = config::thread_default_stack_size, thread_priority priority = thread_priority::normal)
+        {
+            workers.reserve(num_threads);
+            for (std::size_t i = 0; i != num_threads; ++i)
+                workers.emplace_back(priority, stack_size, [this] { run(); });
+        }
+
+        // Finishes all queued jobs before returning.
+        ~thread_pool()
+        {
+            stopping = true;
+            work.notify_all();
+            workers.clear();
+        }
+
+        thread_pool(thread_pool&&) = delete;
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(thread_pool&&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        // Queue a job.  Exceptions thrown from the job are not caught, and
+        // terminate the program, as they would from a thread.
+        void post(job&& j)
+        {
+            push(std::move(j));
+            work.notify_one();
+        }
+
+        // Queue a range of jobs at once.  Workers are woken only after all
+        // jobs are queued.
+        template<std::ranges::input_range R>
+        void post_batch(R&& jobs)
+        {
+            for (auto&& j : jobs)
+                push(job { std::forward<decltype(j)>(j) });
+            work.notify_all();
+        }
+
+        // Queue a function call.  The returned future receives the result or
+        // exception.
+        template<typename F, typename... A>
+        [[nodiscard]] auto submit(F&& func, A&&... args)
+        {
+            auto [j, f] = package(std::forward<F>(func), std::forward<A>(args)...);
+            post(std::move(j));
+            return std::move(f);
+        }
+
+        // Queue a call to each function in the given range, and return their
+        // futures in the same order.
+        template<std::ranges::input_range R>
+        [[nodiscard]] auto submit_batch(R&& funcs)
+        {
+            using result = typename decltype(package(*std::ranges::begin(funcs)))::second_type;
+            std::vector<result> futures;
+            if constexpr (std::ranges::sized_range<R>) futures.reserve(std::ranges::size(funcs));
+            for (auto&& func : funcs)
+            {
+                auto [j, f] = package(std::forward<decltype(func)>(func));
+                push(std::move(j));
+                futures.emplace_back(std::move(f));
+            }
+            work.notify_all();
+            return futures;
+        }
+
+        // Block until the queue is empty and all workers are idle.
+        void wait_idle() const
+        {
+            idle.wait_while([this] { return pending != 0; });
+        }
+
+        std::size_t size() const noexcept { return workers.size(); }
+        std::size_t queued() const noexcept { return jobs.size(); }
+
+    private:
+        void push(job&& j)
+        {
+            dpmi::throw_if_irq();
+            jobs.emplace_back(std::move(j));
+            ++pending;
+        }
+
+        template<typename F, typename... A>
+        static auto package(F&& func, A&&... args)
+        {
+            using result = std::invoke_result_t<std::decay_t<F>, std::decay_t<A>...>;
+            auto call = callable_tuple { std::forward<F>(func), std::forward<A>(args)... };
+            struct packaged
+            {
+                decltype(call) call;
+                promise<result> p;
+            };
+            auto state = std::make_shared<packaged>(std::move(call), promise<result> { });
+            auto f = state->p.get_future();
+            job j { [state = std::move(state)]
+            {
+                try
+                {
+                    if constexpr (std::is_void_v<result>) { state->call(); state->p.set_value(); }
+                    else state->p.set_value(state->call());
+                }
+                catch (const abi::__forced_unwind&) { throw; }
+                catch (...) { state->p.set_exception(std::current_exception()); }
+            } };
+            return std::pair<job, future<result>> { std::move(j), std::move(f) };
+        }
+
+        void run()
+        {
+            while (true)
+            {
+                work.wait_while([this] { return jobs.empty() and not stopping; });
+                if (jobs.empty()) return;
+
+                job j { std::move(jobs.front()) };
+                jobs.pop_front();
+                finally done { [this]
+                {
+                    if (--pending == 0) idle.notify_all();
+                } };
+                j();
+            }
+        }
+
+        std::deque<job> jobs;
+        std::size_t pending { 0 };
+        bool stopping { false };
+        mutable detail::wait_queue work;
+        mutable detail::wait_queue idle;
+        std::vector<jthread> workers;
+    };
+}
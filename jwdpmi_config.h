@@ -1,4 +1,5 @@
 #pragma once
+#include <array>
 #include <crt0.h>
 #include <jw/common.h>
 #include <jw/simd_flags.h>
@@ -27,12 +28,61 @@ namespace jw
         // from directly via 'operator new (jw::locked) T'.
         constexpr std::size_t global_locked_pool_size = 1_MB;
 
-        // Total stack size for interrupt and exception handlers.
-        constexpr std::size_t locked_stack_size = 128_KB;
+        // Size of the locked arena for small allocations (up to 512 bytes)
+        // from the global locked pool.  These are served from per-size free
+        // lists, without disabling interrupts.  Set to 0 to disable.  Not
+        // used on CPUs without cmpxchg8b.
+        constexpr std::size_t locked_slab_size = 256_KB;
+
+        // When the largest free chunk in the global locked pool drops below
+        // this size, a background thread allocates and locks a new chunk of
+        // half the initial pool size, so that interrupt handlers do not run
+        // out.  This costs an extra thread in every program, so it is off
+        // (0) by default.  The pool is then only grown on allocations outside
+        // interrupt context.  Try global_locked_pool_size / 4 if interrupt
+        // handlers allocate a lot.
+        constexpr std::size_t locked_pool_refill_watermark = 0;
+
+        // Stack sizes for interrupt and exception handlers, one region per
+        // nesting level.  A new level is only entered when a handler
+        // interrupts code that is not running on the locked stack, while the
+        // locked stack is already in use.  Sizes are rounded up to whole
+        // pages.  Use dpmi::locked_stack_stats() to find the right sizes.
+        constexpr std::array<std::size_t, 4> locked_stack_sizes { 64_KB, 32_KB, 16_KB, 16_KB };
+
+        // Place an uncommitted guard page below each locked stack region.
+        // Requires DPMI 1.0 page attributes.  Otherwise, or if disabled, a
+        // canary value is checked after each interrupt and exception.
+        constexpr bool locked_stack_guard_pages = true;
 
         // Default stack size for threads.
         constexpr std::size_t thread_default_stack_size = 64_KB;
 
+        // Number of times a runnable thread may be passed over in favour of
+        // higher-priority threads, before it is given a turn regardless.
+        constexpr std::uint32_t thread_starvation_limit = 16;
+
+        // Number of functions that can be queued by thread::invoke() without
+        // allocating memory or masking interrupts.  Must be a power of two.
+        constexpr std::size_t thread_invoke_mailbox_size = 8;
+
+        // Number of stacks to keep for re-use when threads are destroyed, per
+        // power-of-two size class.
+        constexpr std::size_t thread_stack_cache_size = 4;
+
+        // Allocate each thread stack in its own DPMI memory block, with an
+        // uncommitted page below it, so that a stack overflow causes a page
+        // fault.  Requires DPMI 1.0 page attribute support, otherwise this is
+        // silently disabled.  Costs one DPMI memory handle per thread.
+        constexpr bool thread_guard_pages = false;
+
+        // Preserve FPU/MMX/SSE registers for each thread.  If control
+        // registers are accessible (directly or via ring 0), this is done
+        // lazily: CR0.TS is set on a thread switch, and the registers are only
+        // switched when the new thread executes an FPU instruction.  Otherwise
+        // they are saved and restored on every thread switch.
+        constexpr bool thread_save_fpu = true;
+
 #       if defined(NDEBUG) and not defined(HAVE__SSE__)
         // If you need to use floating-point instructions in interrupts,
         // exceptions, or realmode callbacks, you must save and restore the
@@ -67,9 +117,42 @@ namespace jw
         // Allow interrupts while the program is stopped in GDB.
         constexpr bool enable_gdb_interrupts = true;
 
+        // Use the local APIC and IOAPIC for IRQs that have a handler
+        // installed, if available.  This allows IRQ levels above 15 and MSI.
+        // The DPMI host must pass all interrupt vectors to protected mode
+        // handlers (HDPMI does).
+        constexpr bool enable_apic = false;
+
+        // First interrupt vector used by the APIC backend.  The next 48
+        // vectors are reserved for IRQ levels.  Higher vectors have higher
+        // priority.
+        constexpr std::uint8_t apic_vector_base = 0xa0;
+
+        // Interrupt rate limit for IRQs with the 'coalesce' flag.
+        constexpr std::uint32_t irq_coalesce_threshold = 16;
+        constexpr std::uint32_t irq_coalesce_window_us = 1000;
+
         // Collect timing statistics for interrupt handlers.
         constexpr bool collect_irq_stats = true;
 
+        // Measure locked stack usage per IRQ and per stack region.  This
+        // scans and refills the stack region after every outermost
+        // interrupt, which is too slow for high IRQ rates.
+        constexpr bool collect_irq_stack_usage = false;
+
+        // Measure how long interrupts stay disabled by interrupt_mask.  This
+        // adds two RDTSC instructions to every outermost interrupt_mask.
+        constexpr bool collect_interrupt_mask_stats = false;
+
+        // Maximum number of functions queued with dpmi::defer().  Must be a
+        // power of two.
+        constexpr std::size_t irq_deferred_queue_size = 32;
+
+        // Collect run time and scheduling latency statistics for threads.
+        // This adds RDTSC work to every thread switch, and fills new thread
+        // stacks with a pattern, to measure stack usage.
+        constexpr bool collect_thread_stats = false;
+
         // Clock used for gameport timing.
         using gameport_clock = jw::chrono::tsc;
 
@@ -0,0 +1,362 @@
+/* * * * * * * * * * * * * * * * * * jwdpmi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2026 - 2026 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <optional>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <fmt/core.h>
+#include <jw/dpmi/detail/apic.h>
+#include <jw/dpmi/irq_mask.h>
+#include <jw/dpmi/memory.h>
+#include <jw/dpmi/cpuid.h>
+#include <jw/dpmi/bda.h>
+
+namespace jw::dpmi::detail
+{
+    struct [[gnu::packed]] acpi_rsdp
+    {
+        char signature[8];
+        std::uint8_t checksum;
+        char oem_id[6];
+        std::uint8_t revision;
+        std::uint32_t rsdt_address;
+    };
+
+    struct [[gnu::packed]] acpi_header
+    {
+        char signature[4];
+        std::uint32_t length;
+        std::uint8_t revision;
+        std::uint8_t checksum;
+        char oem_id[6];
+        char oem_table_id[8];
+        std::uint32_t oem_revision;
+        std::uint32_t creator_id;
+        std::uint32_t creator_revision;
+    };
+
+    struct [[gnu::packed]] madt_entry
+    {
+        std::uint8_t type;
+        std::uint8_t length;
+    };
+
+    struct [[gnu::packed]] madt_ioapic : madt_entry
+    {
+        std::uint8_t id;
+        std::uint8_t reserved;
+        std::uint32_t address;
+        std::uint32_t gsi_base;
+    };
+
+    struct [[gnu::packed]] madt_source_override : madt_entry
+    {
+        std::uint8_t bus;
+        std::uint8_t source;
+        std::uint32_t gsi;
+        std::uint16_t flags;
+    };
+
+    struct ioapic
+    {
+        std::optional<device_memory<std::uint32_t>> memory;
+        volatile std::uint32_t* regs { nullptr };
+        std::uint32_t gsi_base { 0 };
+        std::uint32_t num_inputs { 0 };
+
+        std::uint32_t read(std::uint8_t reg) const noexcept
+        {
+            regs[0] = reg;                      // IOREGSEL
+            return regs[4];                     // IOWIN
+        }
+
+        void write(std::uint8_t reg, std::uint32_t value) const noexcept
+        {
+            regs[0] = reg;
+            regs[4] = value;
+        }
+    };
+
+    static constinit std::optional<device_memory<std::uint32_t>> lapic_memory;
+    static constinit std::array<ioapic, 4> ioapics { };
+    static constinit std::size_t num_ioapics { 0 };
+    static constinit std::uint32_t lapic_id { 0 };
+
+    // ISA IRQ to GSI mapping, and MPS INTI flags for each ISA IRQ.
+    static constinit std::array<std::uint32_t, 16> isa_gsi { };
+    static constinit std::array<std::uint16_t, 16> isa_flags { };
+
+    static constinit std::bitset<16> pic_was_masked { };
+    static constinit std::bitset<irq_count> msi_allocated { };
+
+    static constexpr io::io_port<byte> pic0_data { 0x21 };
+    static constexpr io::io_port<byte> pic1_data { 0xA1 };
+
+    static bool checksum_ok(const void* p, std::size_t size)
+    {
+        auto* const b = static_cast<const std::uint8_t*>(p);
+        return std::accumulate(b, b + size, std::uint8_t { 0 }) == 0;
+    }
+
+    static const acpi_rsdp* find_rsdp(const std::byte* begin, std::size_t size)
+    {
+        for (std::size_t i = 0; i + sizeof(acpi_rsdp) <= size; i += 16)
+        {
+            auto* const p = reinterpret_cast<const acpi_rsdp*>(begin + i);
+            if (std::memcmp(p->signature, "RSD PTR ", 8) == 0 and checksum_ok(p, sizeof(acpi_rsdp)))
+                return p;
+        }
+        return nullptr;
+    }
+
+    static std::optional<std::uint32_t> find_rsdt()
+    {
+        const std::uintptr_t ebda = bda->read<std::uint16_t>(0x0e) << 4;
+        if (ebda != 0)
+        {
+            mapped_dos_memory<std::byte> mem { 0x400, ebda };
+            if (auto* p = find_rsdp(mem.near_pointer(), mem.size()))
+                return p->rsdt_address;
+        }
+        mapped_dos_memory<std::byte> mem { 0x20000, 0xe0000 };
+        if (auto* p = find_rsdp(mem.near_pointer(), mem.size()))
+            return p->rsdt_address;
+        return std::nullopt;
+    }
+
+    static std::optional<device_memory<std::byte>> map_table(std::uint32_t address, const char* signature)
+    {
+        std::uint32_t length;
+        {
+            device_memory<acpi_header> header { 1, address };
+            if (std::memcmp(header->signature, signature, 4) != 0) return std::nullopt;
+            length = header->length;
+        }
+        device_memory<std::byte> table { length, address };
+        if (not checksum_ok(table.near_pointer(), length)) return std::nullopt;
+        return table;
+    }
+
+    static std::optional<device_memory<std::byte>> find_madt()
+    {
+        const auto rsdt_address = find_rsdt();
+        if (not rsdt_address) return std::nullopt;
+        const auto rsdt = map_table(*rsdt_address, "RSDT");
+        if (not rsdt) return std::nullopt;
+
+        const auto n = (rsdt->size() - sizeof(acpi_header)) / 4;
+        auto* const entries = reinterpret_cast<const std::uint32_t*>(rsdt->near_pointer() + sizeof(acpi_header));
+        for (std::size_t i = 0; i != n; ++i)
+            if (auto madt = map_table(entries[i], "APIC"))
+                return madt;
+        return std::nullopt;
+    }
+
+    static ioapic* find_ioapic(std::uint32_t gsi) noexcept
+    {
+        for (std::size_t i = 0; i != num_ioapics; ++i)
+        {
+            auto& io = ioapics[i];
+            if (gsi >= io.gsi_base and gsi < io.gsi_base + io.num_inputs)
+                return &io;
+        }
+        return nullptr;
+    }
+
+    static std::optional<std::uint32_t> irq_to_gsi(std::uint8_t irq) noexcept
+    {
+        if (irq < 16) return isa_gsi[irq];
+        if (irq < first_msi_irq) return irq;
+        return std::nullopt;
+    }
+
+    bool apic::setup()
+    {
+        if (not cpuid::feature_flags().apic_on_chip) return false;
+
+        try
+        {
+            const auto madt = find_madt();
+            if (not madt) return false;
+
+            for (unsigned i = 0; i != 16; ++i)
+            {
+                isa_gsi[i] = i;
+                isa_flags[i] = 0;
+            }
+
+            const std::byte* const begin = madt->near_pointer();
+            const std::byte* const end = begin + madt->size();
+            const auto lapic_address = *reinterpret_cast<const std::uint32_t*>(begin + sizeof(acpi_header));
+
+            for (auto* p = begin + sizeof(acpi_header) + 8; p + sizeof(madt_entry) <= end;)
+            {
+                auto* const e = reinterpret_cast<const madt_entry*>(p);
+                if (e->length < sizeof(madt_entry)) break;
+                switch (e->type)
+                {
+                case 1:
+                    if (num_ioapics != ioapics.size())
+                    {
+                        auto* const m = static_cast<const madt_ioapic*>(e);
+                        auto& io = ioapics[num_ioapics++];
+                        io.memory.emplace(0x20 / 4, m->address);
+                        io.regs = io.memory->near_pointer();
+                        io.gsi_base = m->gsi_base;
+                        io.num_inputs = ((io.read(0x01) >> 16) & 0xff) + 1;
+                    }
+                    break;
+
+                case 2:
+                    if (auto* const s = static_cast<const madt_source_override*>(e); s->bus == 0 and s->source < 16)
+                    {
+                        isa_gsi[s->source] = s->gsi;
+                        isa_flags[s->source] = s->flags;
+                    }
+                    break;
+                }
+                p += e->length;
+            }
+
+            if (num_ioapics == 0) return false;
+
+            lapic_memory.emplace(0x400 / 4, lapic_address);
+            volatile std::uint32_t* const r = lapic_memory->near_pointer();
+            lapic_id = r[0x20 / 4] >> 24;
+
+            // If the BIOS left the local APIC disabled, set it up for
+            // virtual wire mode first, so the PIC keeps working.
+            if (not (r[0xf0 / 4] & 0x100))
+            {
+                r[0x350 / 4] = 0x700;           // LINT0: ExtINT
+                r[0x360 / 4] = 0x400;           // LINT1: NMI
+                r[0xf0 / 4] = 0x1ff;            // enable, spurious vector 0xff
+            }
+
+            lapic = r;
+            return true;
+        }
+        catch (const dpmi_error&)
+        {
+            disable();
+            return false;
+        }
+    }
+
+    void apic::disable() noexcept
+    {
+        lapic = nullptr;
+        for (auto& io : ioapics) io.memory.reset();
+        num_ioapics = 0;
+        lapic_memory.reset();
+    }
+
+    void apic::route(std::uint8_t irq)
+    {
+        if (irq >= first_msi_irq)
+        {
+            is_routed[irq] = true;
+            return;
+        }
+
+        const auto gsi = *irq_to_gsi(irq);
+        auto* const io = find_ioapic(gsi);
+        if (io == nullptr)
+            throw std::runtime_error { fmt::format("No IOAPIC input for IRQ {}", irq) };
+
+        // ISA interrupts are edge-triggered and active-high, PCI interrupts
+        // are level-triggered and active-low, unless overridden by the MADT.
+        const auto flags = irq < 16 ? isa_flags[irq] : 0b1111;
+        const bool active_low = (flags & 0b11) == 0b11;
+        const bool level = ((flags >> 2) & 0b11) == 0b11;
+
+        std::uint32_t lo = vector(irq);
+        lo |= active_low << 13;
+        lo |= level << 15;
+        lo |= 1 << 16;                          // masked
+
+        const std::uint8_t reg = 0x10 + (gsi - io->gsi_base) * 2;
+        interrupt_mask no_irq { };
+        io->write(reg + 1, lapic_id << 24);
+        io->write(reg, lo);
+
+        if (irq < 16)
+        {
+            auto& port = irq < 8 ? pic0_data : pic1_data;
+            const byte bit = 1 << (irq % 8);
+            const auto current = port.read();
+            pic_was_masked[irq] = current & bit;
+            port.write(current | bit);
+        }
+        is_routed[irq] = true;
+    }
+
+    void apic::unroute(std::uint8_t irq) noexcept
+    {
+        if (not is_routed[irq]) return;
+        interrupt_mask no_irq { };
+        is_routed[irq] = false;
+        if (irq >= first_msi_irq) return;
+
+        const auto gsi = *irq_to_gsi(irq);
+        auto* const io = find_ioapic(gsi);
+        const std::uint8_t reg = 0x10 + (gsi - io->gsi_base) * 2;
+        io->write(reg, io->read(reg) | (1 << 16));
+
+        if (irq < 16)
+        {
+            auto& port = irq < 8 ? pic0_data : pic1_data;
+            const byte bit = 1 << (irq % 8);
+            const auto current = port.read();
+            port.write(pic_was_masked[irq] ? (current | bit) : (current & ~bit));
+        }
+    }
+
+    bool apic::mask(std::uint8_t irq, bool masked) noexcept
+    {
+        if (irq >= first_msi_irq) return false;
+        const auto gsi = *irq_to_gsi(irq);
+        auto* const io = find_ioapic(gsi);
+        const std::uint8_t reg = 0x10 + (gsi - io->gsi_base) * 2;
+        interrupt_mask no_irq { };
+        const auto lo = io->read(reg);
+        io->write(reg, masked ? (lo | (1 << 16)) : (lo & ~(1 << 16)));
+        return lo & (1 << 16);
+    }
+
+    bool apic::is_masked(std::uint8_t irq) noexcept
+    {
+        if (irq >= first_msi_irq) return false;
+        const auto gsi = *irq_to_gsi(irq);
+        auto* const io = find_ioapic(gsi);
+        const std::uint8_t reg = 0x10 + (gsi - io->gsi_base) * 2;
+        interrupt_mask no_irq { };
+        return io->read(reg) & (1 << 16);
+    }
+
+    std::uint8_t apic::allocate_msi()
+    {
+        interrupt_mask no_irq { };
+        for (std::uint8_t i = first_msi_irq; i != irq_count; ++i)
+        {
+            if (not msi_allocated[i])
+            {
+                msi_allocated[i] = true;
+                return i;
+            }
+        }
+        throw std::runtime_error { "No free MSI levels." };
+    }
+
+    void apic::free_msi(std::uint8_t irq) noexcept
+    {
+        interrupt_mask no_irq { };
+        msi_allocated[irq] = false;
+    }
+
+    std::uint32_t apic::msi_address() noexcept
+    {
+        return 0xfee00000 | (lapic_id << 12);
+    }
+}
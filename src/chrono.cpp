@@ -460,6 +460,12 @@ namespace jw::chrono
         return duration { static_cast<std::int64_t>(round(count * float_ns_per_tsc_tick)) };
     }
 
+    std::int64_t tsc::to_count(duration d)
+    {
+        if (not tsc_calibrated) [[unlikely]] return 0;
+        return static_cast<std::int64_t>(round(d.count() / float_ns_per_tsc_tick));
+    }
+
     tsc::time_point tsc::to_time_point(tsc_count tsc)
     {
         decltype(pit_ns) pit;
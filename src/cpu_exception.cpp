@@ -29,6 +29,7 @@ namespace jw::dpmi::detail
     static constinit std::array<std::optional<exception_handler>, 0x1f> exception_handlers { };
     static constinit std::bitset<async_signal::max_signals> available_signals { ~ std::uint64_t { 0 } };
     static constinit std::bitset<async_signal::max_signals> pending_signals { 0 };
+    static constinit std::optional<memory_base> locked_stack_memory { };
 
     template<typename T>
     static T* allocate_trampoline()
@@ -102,6 +103,24 @@ namespace jw::dpmi::detail
     [[gnu::cdecl]]
     static bool handle_exception(raw_exception_frame* frame) noexcept
     {
+        if (locked_stack_exhausted()) [[unlikely]]
+        {
+            fmt::print(stderr, "Out of locked stacks handling exception 0x{:0>2x}\n", frame->data->num.value);
+            halt();
+        }
+
+        // Lazy FPU switching must be handled before anything else touches
+        // the FPU, including the fpu_context below.
+        if constexpr (config::thread_save_fpu)
+        {
+            if (frame->data->num == exception_num::device_not_available
+                and jw::detail::scheduler::handle_fpu_trap())
+            {
+                asm ("cli");
+                return true;
+            }
+        }
+
         constexpr bool save_fpu { config::save_fpu_on_exception };
         std::conditional_t<save_fpu, fpu_context, empty> fpu;
 
@@ -138,13 +157,11 @@ namespace jw::dpmi::detail
             }
         }
 
-#       ifndef NDEBUG
-        if (*reinterpret_cast<const std::uint32_t*>(locked_stack.data()) != 0xdeadbeef) [[unlikely]]
+        if (locked_stack_overflow()) [[unlikely]]
         {
             fmt::print(stderr, "Stack overflow handling exception 0x{:0>2x}\n", data->num.value);
             halt();
         }
-#       endif
 
         asm ("cli");
         return success;
@@ -394,16 +411,68 @@ namespace jw::dpmi::detail
         return false;
     }
 
+    void setup_locked_stacks()
+    {
+        std::array<std::size_t, locked_stack_levels> sizes;
+        std::size_t total = 0;
+        for (std::size_t i = 0; i != locked_stack_levels; ++i)
+        {
+            sizes[i] = round_up_to_page_size(config::locked_stack_sizes[i]);
+            total += sizes[i];
+        }
+
+        // Layout: [guard][level 0][guard][level 1]...
+        if constexpr (config::locked_stack_guard_pages)
+        {
+            try
+            {
+                const page_attributes guard { page_attributes::uncommitted, false };
+                locked_stack_memory.emplace(total + locked_stack_levels * page_size, true);
+                std::size_t offset = 0;
+                for (auto size : sizes)
+                {
+                    locked_stack_memory->set_page_attributes(offset, { &guard, 1 });
+                    offset += page_size;
+                    linear_memory { locked_stack_memory->address() + offset, size }.lock();
+                    offset += size;
+                }
+                locked_stack_guarded = true;
+            }
+            catch (const dpmi_error&)
+            {
+                locked_stack_memory.reset();
+            }
+        }
+        if (not locked_stack_guarded)
+        {
+            locked_stack_memory.emplace(total, true);
+            locked_stack_memory->lock();
+        }
+        auto* p = locked_stack_memory->near_pointer<std::byte>();
+
+        for (std::size_t i = 0; i != locked_stack_levels; ++i)
+        {
+            if (locked_stack_guarded) p += page_size;
+            auto& r = locked_stacks[i];
+            r.bottom = reinterpret_cast<std::uint32_t*>(p);
+            r.top = reinterpret_cast<std::uint32_t*>(p + sizes[i]);
+            r.max_used = 0;
+            std::fill(r.bottom, r.top, locked_stack_pattern);
+            p += sizes[i];
+        }
+    }
+
     void setup_exception_handling()
     {
         constinit static bool done { false };
         if (done) return;
         done = true;
 
+        setup_locked_stacks();
+
         for (auto& i : trampoline_pool) i.next_free = &i + 1;
         trampoline_pool.back().next_free = nullptr;
         free_list = trampoline_pool.begin();
-        *reinterpret_cast<std::uint32_t*>(locked_stack.data()) = 0xdeadbeef;
 
         pending_exceptions.emplace();
 
@@ -0,0 +1,230 @@
+/* * * * * * * * * * * * * * * * * * jwdpmi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2017 - 2026 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <jw/io/dos_file.h>
+#include <jw/dpmi/realmode.h>
+#include <algorithm>
+#include <cstring>
+
+namespace jw::io
+{
+    using dos_buffer = std::unique_ptr<dpmi::dos_memory<std::byte>>;
+
+    static constinit std::vector<dos_buffer>* buffer_pool { nullptr };
+
+    static dos_buffer take_buffer(std::size_t size)
+    {
+        if (buffer_pool != nullptr)
+        {
+            auto i = std::find_if(buffer_pool->begin(), buffer_pool->end(), [size](auto& b) { return b->size() >= size; });
+            if (i != buffer_pool->end())
+            {
+                auto b = std::move(*i);
+                buffer_pool->erase(i);
+                return b;
+            }
+        }
+        return std::make_unique<dpmi::dos_memory<std::byte>>(size);
+    }
+
+    static void return_buffer(dos_buffer&& b)
+    {
+        if (not b) return;
+        if (buffer_pool == nullptr) buffer_pool = new std::vector<dos_buffer> { };
+        buffer_pool->push_back(std::move(b));
+    }
+
+    void dos_file::free_buffers() noexcept
+    {
+        if (buffer_pool != nullptr) buffer_pool->clear();
+    }
+
+    static void dos_call(dpmi::realmode_registers& reg, const char* where)
+    {
+        reg.call_int(0x21);
+        if (reg.flags.carry) throw dos_error { reg.ax, where };
+    }
+
+    dos_file::dos_file(const char* filename, const dos_file_config& cfg)
+    {
+        if (cfg.buffer_size == 0 or cfg.buffer_size >= 64_KB)
+            throw std::invalid_argument { "Invalid buffer size" };
+        if (cfg.num_buffers == 0)
+            throw std::invalid_argument { "Need at least one buffer" };
+
+        try
+        {
+            buffers.reserve(cfg.num_buffers);
+            for (std::size_t i = 0; i < cfg.num_buffers; ++i)
+                buffers.emplace_back(take_buffer(cfg.buffer_size), 0);
+
+            auto& b = *buffers.front().memory;
+            const auto len = std::strlen(filename);
+            if (len >= b.size()) throw std::invalid_argument { "File name too long" };
+            std::copy_n(reinterpret_cast<const std::byte*>(filename), len + 1, b.near_pointer());
+
+            dpmi::realmode_registers reg { };
+            reg.ax = 0x3d00;
+            reg.ds = b.dos_pointer().segment;
+            reg.dx = b.dos_pointer().offset;
+            dos_call(reg, __PRETTY_FUNCTION__);
+            handle = reg.ax;
+
+            try
+            {
+                reg = { };
+                reg.ax = 0x4202;
+                reg.bx = handle;
+                dos_call(reg, __PRETTY_FUNCTION__);
+                file_size = std::uint32_t { reg.dx } << 16 | reg.ax;
+                set_file_pointer(0);
+            }
+            catch (...)
+            {
+                reg = { };
+                reg.ah = 0x3e;
+                reg.bx = handle;
+                reg.call_int(0x21);
+                throw;
+            }
+        }
+        catch (...)
+        {
+            for (auto& b : buffers) return_buffer(std::move(b.memory));
+            throw;
+        }
+
+        for (auto& b : buffers) b.size = 0;
+        if (cfg.read_ahead and buffers.size() > 1)
+            thread = jthread { [this](std::stop_token stop) { read_ahead_thread(stop); } };
+    }
+
+    dos_file::~dos_file()
+    {
+        if (thread.joinable())
+        {
+            {
+                std::unique_lock lock { mutex };
+                thread.request_stop();
+                released.notify_all();
+            }
+            thread.join();
+        }
+
+        dpmi::realmode_registers reg { };
+        reg.ah = 0x3e;
+        reg.bx = handle;
+        reg.call_int(0x21);
+
+        for (auto& b : buffers) return_buffer(std::move(b.memory));
+    }
+
+    void dos_file::set_file_pointer(std::uint32_t p)
+    {
+        dpmi::realmode_registers reg { };
+        reg.ax = 0x4200;
+        reg.bx = handle;
+        reg.cx = p >> 16;
+        reg.dx = p;
+        dos_call(reg, __PRETTY_FUNCTION__);
+    }
+
+    // Reads into the next free buffer.  The mutex must be held.
+    void dos_file::fill()
+    {
+        auto& b = buffers[(read_index + num_full) % buffers.size()];
+        const auto n = std::min<std::size_t>(b.memory->size(), file_size - fill_pos);
+        dpmi::realmode_registers reg { };
+        reg.ah = 0x3f;
+        reg.bx = handle;
+        reg.cx = n;
+        reg.ds = b.memory->dos_pointer().segment;
+        reg.dx = b.memory->dos_pointer().offset;
+        dos_call(reg, __PRETTY_FUNCTION__);
+        if (reg.ax < n) file_size = fill_pos + reg.ax;   // File was truncated.
+        b.size = reg.ax;
+        fill_pos += reg.ax;
+        ++num_full;
+    }
+
+    void dos_file::read_ahead_thread(std::stop_token stop)
+    {
+        auto idle = [&]
+        {
+            return num_full == buffers.size() or fill_pos >= file_size or error;
+        };
+
+        std::unique_lock lock { mutex };
+        while (true)
+        {
+            released.wait(lock, [&] { return not idle() or stop.stop_requested(); });
+            if (stop.stop_requested()) return;
+
+            try { fill(); }
+            catch (...) { error = std::current_exception(); }
+        }
+    }
+
+    void dos_file::release_current() noexcept
+    {
+        if (not have_current) return;
+        have_current = false;
+        read_index = (read_index + 1) % buffers.size();
+        --num_full;
+    }
+
+    // Makes the next buffer current.  Returns false at end of file.
+    // If the read-ahead thread is filling a buffer, this waits for it on
+    // the mutex.
+    bool dos_file::next()
+    {
+        std::unique_lock lock { mutex };
+        release_current();
+        released.notify_one();
+        if (error) std::rethrow_exception(std::exchange(error, nullptr));
+        if (pos >= file_size) return false;
+        if (num_full == 0) fill();
+
+        auto& b = buffers[read_index];
+        current = { b.memory->near_pointer(), b.size };
+        have_current = true;
+        return not current.empty();
+    }
+
+    std::span<const std::byte> dos_file::read()
+    {
+        if (current.empty() and not next()) return { };
+        auto r = current;
+        current = { };
+        pos += r.size();
+        return r;
+    }
+
+    std::size_t dos_file::read(std::span<std::byte> out)
+    {
+        std::size_t n = 0;
+        while (n < out.size())
+        {
+            if (current.empty() and not next()) break;
+            const auto size = std::min(current.size(), out.size() - n);
+            std::copy_n(current.begin(), size, out.begin() + n);
+            current = current.subspan(size);
+            pos += size;
+            n += size;
+        }
+        return n;
+    }
+
+    void dos_file::seek(std::uint32_t p)
+    {
+        std::unique_lock lock { mutex };
+        p = std::min(p, file_size);
+        set_file_pointer(p);
+        have_current = false;
+        current = { };
+        read_index = 0;
+        num_full = 0;
+        pos = fill_pos = p;
+        released.notify_one();
+    }
+}
@@ -2,12 +2,15 @@
 /*    Copyright (C) 2017 - 2025 J.W. Jagersma, see COPYING.txt for details    */
 
 #include <algorithm>
+#include <bit>
 #include <optional>
+#include <memory>
 #include <cstddef>
 #include <fmt/core.h>
 #include <jw/main.h>
 #include <jw/thread.h>
 #include <jw/dpmi/irq_handler.h>
+#include <jw/dpmi/realmode.h>
 #include <jw/dpmi/detail/selectors.h>
 #include <jw/dpmi/detail/stack.h>
 #include <jw/chrono.h>
@@ -17,13 +20,28 @@
 
 namespace jw::dpmi::detail
 {
-    using irq_time_t = std::array<std::array<std::uint32_t, 32>, 16>;
+    using irq_time_t = std::array<std::array<std::uint32_t, 32>, irq_count>;
 
     static constinit std::uint32_t spurious;
     static constinit bool have_rdtsc;
+    static constinit std::bitset<irq_count> throttled { };
+    static constinit std::atomic<bool> polling { false };
     static constinit std::conditional_t<config::collect_irq_stats, irq_stats_t, std::monostate> stats;
     static constinit std::conditional_t<config::collect_irq_stats, irq_time_t, std::monostate> irq_time;
 
+    struct deferred_item
+    {
+        function<void(), 4> func;
+        chrono::tsc_count posted;
+
+        void operator()();
+    };
+
+    static constinit jw::detail::invoke_mailbox<deferred_item, config::irq_deferred_queue_size> deferred;
+    static constinit std::atomic<bool> deferred_running { false };
+    static constinit std::conditional_t<config::collect_irq_stats, deferred_stats_t, std::monostate> deferred_stats { };
+    static constinit std::conditional_t<config::collect_irq_stats, std::array<std::uint32_t, 32>, std::monostate> deferred_time;
+
     void irq_entry_point() noexcept
     {
         asm
@@ -45,6 +63,14 @@ namespace jw::dpmi::detail
             mov ss, edi
             mov esp, eax
         L%=keep_stack:
+            xor eax, eax
+            xor edx, edx
+            cmp %[have_rdtsc], 0
+            je L%=no_tsc
+            rdtsc                   # entry time, for latency statistics
+        L%=no_tsc:
+            push edx
+            push eax
             push fs:[ebp+0x30]      # IRQ number set by trampoline
             call %[handle_irq]      # call user interrupt handlers
             cmp bx, di
@@ -64,11 +90,72 @@ namespace jw::dpmi::detail
         )" : :
             [ds]         "i" (&safe_ds),
             [use_count]  "m" (locked_stack_use_count),
+            [have_rdtsc] "m" (have_rdtsc),
             [handle_irq] "i" (irq_controller::handle_irq),
             [get_stack]  "i" (get_locked_stack)
         );
     }
 
+    void fast_irq_entry_point() noexcept
+    {
+        asm
+        (R"(
+            push ds
+            push es
+            push eax
+            push ecx
+            push edx
+            push ebx
+            push esi
+            push ebp
+            mov ebx, ss
+            mov esi, cs:[%[ds]]
+            mov ecx, [esp+0x20]     # IRQ number set by trampoline
+            mov ebp, esp
+            mov ds, esi
+            mov es, esi
+            cmp bx, si
+            je L%=keep_stack
+            call %[get_stack]
+            mov ss, esi
+            mov esp, eax
+        L%=keep_stack:
+            xor eax, eax
+            xor edx, edx
+            cmp %[have_rdtsc], 0
+            je L%=no_tsc
+            rdtsc
+        L%=no_tsc:
+            push edx
+            push eax
+            push ecx
+            call %[handle_irq]
+            cmp bx, si
+            je L%=ret_same_stack
+            dec %[use_count]
+            mov ss, ebx
+        L%=ret_same_stack:
+            mov esp, ebp
+            pop ebp
+            pop esi
+            pop ebx
+            pop edx
+            pop ecx
+            pop eax
+            pop es
+            pop ds
+            add esp, 4              # pop IRQ number
+            sti
+            iret
+        )" : :
+            [ds]         "i" (&safe_ds),
+            [use_count]  "m" (locked_stack_use_count),
+            [have_rdtsc] "m" (have_rdtsc),
+            [handle_irq] "i" (irq_controller::handle_fast_irq),
+            [get_stack]  "i" (get_locked_stack)
+        );
+    }
+
     template<unsigned N>
     [[gnu::naked, gnu::hot]]
     static void irq_trampoline() noexcept
@@ -83,9 +170,14 @@ namespace jw::dpmi::detail
         );
     }
 
+    // With the PIC, IRQ 7 and 15 may be spurious.  These trampolines check
+    // the in-service register first.
+    template<unsigned N>
+    static void spurious_irq_trampoline() noexcept;
+
     template<>
     [[gnu::naked, gnu::hot]]
-    void irq_trampoline<7>() noexcept
+    void spurious_irq_trampoline<7>() noexcept
     {
         asm
         (
@@ -111,7 +203,7 @@ namespace jw::dpmi::detail
 
     template<>
     [[gnu::naked, gnu::hot]]
-    void irq_trampoline<15>() noexcept
+    void spurious_irq_trampoline<15>() noexcept
     {
         asm
         (
@@ -137,23 +229,165 @@ namespace jw::dpmi::detail
         );
     }
 
+    template<unsigned N>
+    [[gnu::naked, gnu::hot]]
+    static void fast_irq_trampoline() noexcept
+    {
+        asm
+        (
+        R"( push %0     # IRQ number
+            jmp %1 )"
+            :
+            : "i" (N)
+            , "i" (fast_irq_entry_point)
+        );
+    }
+
+    static bool needs_spurious_check(irq_level i) noexcept
+    {
+        return (i == 7 or i == 15) and not apic::routed(i);
+    }
+
     static std::uintptr_t get_trampoline(irq_level i)
     {
         constexpr static auto array = []<std::size_t... I> (std::index_sequence<I...>) {
             return std::array<decltype(&irq_trampoline<0>), sizeof...(I)> { irq_trampoline<I>... };
-        } (std::make_index_sequence<16> { });
+        } (std::make_index_sequence<irq_count> { });
+        if (needs_spurious_check(i))
+            return reinterpret_cast<std::uintptr_t>(i == 7 ? spurious_irq_trampoline<7> : spurious_irq_trampoline<15>);
+        return reinterpret_cast<std::uintptr_t>(array[i]);
+    }
+
+    static std::uintptr_t get_fast_trampoline(irq_level i)
+    {
+        constexpr static auto array = []<std::size_t... I> (std::index_sequence<I...>) {
+            return std::array<decltype(&fast_irq_trampoline<0>), sizeof...(I)> { fast_irq_trampoline<I>... };
+        } (std::make_index_sequence<irq_count> { });
         return reinterpret_cast<std::uintptr_t>(array[i]);
     }
 
-    void irq_controller::handle_irq(irq_level i) noexcept
+    static std::size_t histogram_bucket(std::uint32_t t) noexcept
     {
-        [[maybe_unused]] chrono::tsc_count t_enter = 0;
+        return std::min<std::size_t>(std::bit_width(t >> 10), 15);
+    }
+
+    [[gnu::hot]]
+    static chrono::tsc_count irq_stats_enter(irq_level i) noexcept
+    {
+        chrono::tsc_count t_enter = 0;
         if constexpr (config::collect_irq_stats)
         {
             if (have_rdtsc) [[likely]]
                 t_enter = chrono::rdtsc();
             ++stats.irq[i].count;
         }
+        return t_enter;
+    }
+
+    [[gnu::hot]]
+    static void irq_stats_dispatch(irq_level i, [[maybe_unused]] chrono::tsc_count t_entry) noexcept
+    {
+        if constexpr (config::collect_irq_stats) if (have_rdtsc) [[likely]]
+        {
+            const std::uint32_t t = chrono::rdtsc() - t_entry;
+            auto& s = stats.irq[i];
+            s.max_latency = max(s.max_latency, t);
+            ++s.latency_histogram[histogram_bucket(t)];
+        }
+    }
+
+    [[gnu::hot]]
+    static void irq_stats_leave(irq_level i, [[maybe_unused]] chrono::tsc_count t_enter) noexcept
+    {
+        if constexpr (config::collect_irq_stats) if (have_rdtsc) [[likely]]
+        {
+            const std::uint32_t t = chrono::rdtsc() - t_enter;
+            auto& s = stats.irq[i];
+            irq_time[i][(s.count - 1) & (irq_time[i].size() - 1)] = t;
+            s.min = min(s.min, t);
+            s.max = max(s.max, t);
+            ++s.histogram[histogram_bucket(t)];
+        }
+    }
+
+    std::uint64_t irq_handler_data::stats_enter() noexcept
+    {
+        if (have_rdtsc) [[likely]]
+            return chrono::rdtsc();
+        return 0;
+    }
+
+    void irq_handler_data::stats_leave(std::uint64_t t_enter) noexcept
+    {
+        ++stats.count;
+        if (not have_rdtsc) [[unlikely]] return;
+        const std::uint32_t t = chrono::rdtsc() - t_enter;
+        stats.cycles += t;
+        stats.min = min(stats.min, t);
+        stats.max = max(stats.max, t);
+        ++stats.histogram[histogram_bucket(t)];
+    }
+
+    irq_handler_stats_t irq_handler_data::get_stats() const noexcept
+    {
+        if constexpr (config::collect_irq_stats)
+        {
+            auto s = stats;
+            if (s.count != 0) s.avg = s.cycles / s.count;
+            else s.min = 0;
+            return s;
+        }
+        else return { };
+    }
+
+    static constinit interrupt_mask_stats_t mask_stats { };
+
+    std::uint64_t interrupts_off_begin() noexcept
+    {
+        static const bool tsc = dpmi::cpuid::feature_flags().time_stamp_counter;
+        if (tsc) [[likely]]
+            return chrono::rdtsc();
+        return 0;
+    }
+
+    void interrupts_off_end(std::uint64_t t_begin) noexcept
+    {
+        const std::uint32_t t = chrono::rdtsc() - t_begin;
+        mask_stats.max = max(mask_stats.max, t);
+        ++mask_stats.histogram[histogram_bucket(t)];
+        ++mask_stats.count;
+    }
+
+    // If the locked stacks ran out, this handler overwrote the frames of an
+    // interrupted one, so there is nothing to return to.
+    static void check_locked_stack(irq_level i) noexcept
+    {
+        if (locked_stack_exhausted()) [[unlikely]]
+        {
+            fmt::print(stderr, "Out of locked stacks handling IRQ {:d}\n", i);
+            halt();
+        }
+    }
+
+    void irq_controller::handle_fast_irq(irq_level i, chrono::tsc_count t_entry) noexcept
+    {
+        check_locked_stack(i);
+        const auto t_enter = irq_stats_enter(i);
+        {
+            empty fpu;
+            interrupt_id id { &fpu, i, interrupt_type::irq };
+            id.acknowledged = ack::yes;
+            irq_stats_dispatch(i, t_entry);
+            data->get(i)->first->call();
+            send_eoi(i);
+        }
+        irq_stats_leave(i, t_enter);
+    }
+
+    void irq_controller::handle_irq(irq_level i, chrono::tsc_count t_entry) noexcept
+    {
+        check_locked_stack(i);
+        const auto t_enter = irq_stats_enter(i);
 
         {
             constexpr bool save_fpu { config::save_fpu_on_interrupt };
@@ -164,6 +398,9 @@ namespace jw::dpmi::detail
             {
                 auto* const entry = data->get(i);
                 const auto flags = entry->flags;
+                if (flags & coalesce) [[unlikely]]
+                    entry->count_for_coalescing();
+
                 if (not (flags & (always_chain | no_auto_eoi | late_eoi)))
                 {
                     send_eoi(i);
@@ -176,6 +413,7 @@ namespace jw::dpmi::detail
                     if (not (flags & no_interrupts)) asm ("sti");
                     else if (flags & no_reentry) mask.emplace(i);
 
+                    irq_stats_dispatch(i, t_entry);
                     entry->first->call();
 
                     if (((flags & fallback_handler) != 0)
@@ -208,21 +446,130 @@ namespace jw::dpmi::detail
                 fmt::print(stderr, "No EOI for IRQ {:d}\n", i);
                 halt();
             }
+#endif
 
-            if (*reinterpret_cast<const std::uint32_t*>(locked_stack.data()) != 0xdeadbeef) [[unlikely]]
+            if (locked_stack_overflow()) [[unlikely]]
             {
                 fmt::print(stderr, "Stack overflow handling IRQ {:d}\n", i);
                 halt();
             }
-#endif
         }
 
+        irq_stats_leave(i, t_enter);
+
+        // If this is the outermost interrupt, the EOI has been sent, so
+        // deferred work can run here with interrupts enabled.
+        if (interrupt_count == 0)
+        {
+            constexpr bool save_fpu { config::save_fpu_on_interrupt };
+            std::conditional_t<save_fpu, fpu_context, empty> fpu;
+            interrupt_id id { &fpu, i, interrupt_type::irq };
+            id.acknowledged = ack::yes;
+
+            try
+            {
+                finally cli { [] { asm ("cli"); } };
+                asm ("sti");
+                run_deferred();
+                poll();
+            }
+            catch (...)
+            {
+                fmt::print(stderr, "Exception in deferred function from IRQ {:d}\n", i);
+                try { print_exception(); }
+                catch (...) { halt(); }
+                halt();
+            }
+
+            // The outermost IRQ always runs on a fresh locked stack region.
+            if constexpr (config::collect_irq_stack_usage)
+            {
+                const auto used = measure_locked_stack(current_locked_stack());
+                stats.irq[i].stack_used = max(stats.irq[i].stack_used, used);
+            }
+        }
+    }
+
+    void deferred_item::operator()()
+    {
         if constexpr (config::collect_irq_stats) if (have_rdtsc) [[likely]]
         {
+            const auto t_enter = chrono::rdtsc();
+            auto& s = deferred_stats;
+            const std::uint32_t latency = t_enter - posted;
+            s.max_latency = max(s.max_latency, latency);
+            func();
             const std::uint32_t t = chrono::rdtsc() - t_enter;
-            irq_time[i][(stats.irq[i].count - 1) & (irq_time[i].size() - 1)] = t;
-            stats.irq[i].min = min(stats.irq[i].min, t);
-            stats.irq[i].max = max(stats.irq[i].max, t);
+            deferred_time[s.count++ & (deferred_time.size() - 1)] = t;
+            s.min = min(s.min, t);
+            s.max = max(s.max, t);
+            return;
+        }
+        func();
+    }
+
+    void run_deferred()
+    {
+        if (deferred_running.exchange(true, std::memory_order_acquire)) return;
+        finally done { [] { deferred_running.store(false, std::memory_order_release); } };
+        deferred.run();
+    }
+
+    void irq_controller::count_for_coalescing() noexcept
+    {
+        if (window_cycles == 0) return;
+        const auto now = chrono::rdtsc();
+        if (now - window_start > window_cycles)
+        {
+            window_start = now;
+            window_count = 0;
+        }
+        if (++window_count >= config::irq_coalesce_threshold and not throttle)
+        {
+            throttle.emplace(irq);
+            throttled[irq] = true;
+        }
+    }
+
+    void irq_controller::poll() noexcept
+    {
+        if (throttled.none()) [[likely]] return;
+        if (polling.exchange(true, std::memory_order_acquire)) return;
+        finally done { [] { polling.store(false, std::memory_order_release); } };
+
+        for (irq_level i = 0; i != irq_count; ++i)
+        {
+            interrupt_mask no_irqs_here { };
+            if (not throttled[i]) continue;
+            auto* const e = data->get(i);
+
+            constexpr bool save_fpu { config::save_fpu_on_interrupt };
+            std::conditional_t<save_fpu, fpu_context, empty> fpu;
+            interrupt_id id { &fpu, i, interrupt_type::irq };
+            id.acknowledged = ack::polled;
+
+            try
+            {
+                e->first->call();
+                if (((e->flags & fallback_handler) != 0)
+                    & (id.acknowledged != ack::yes))
+                    e->fallback->call();
+            }
+            catch (...)
+            {
+                fmt::print(stderr, "Exception while polling IRQ {:d}\n", i);
+                try { print_exception(); }
+                catch (...) { halt(); }
+                halt();
+            }
+
+            // Nothing to do, so the burst is over.
+            if (id.acknowledged != ack::yes)
+            {
+                throttled[i] = false;
+                e->window_count = 0;
+                e->throttle.reset();
+            }
         }
     }
 
@@ -257,29 +604,83 @@ namespace jw::dpmi::detail
         return ptr;
     }
 
+    irq_level irq_controller::route(irq_level i)
+    {
+        if (apic::enabled()) apic::route(i);
+        else if (i >= 16)
+            throw std::out_of_range { fmt::format("IRQ {} requires the APIC", i) };
+        return i;
+    }
+
+    // The DPMI host only reflects IRQs on the PIC vectors from real mode.
+    // An IRQ routed through the APIC that arrives in real mode goes through
+    // the real-mode IVT, so that needs a callback to protected mode.
+    struct irq_controller::realmode_reflector
+    {
+        realmode_reflector(irq_level i)
+            : callback { [i] (realmode_registers*, far_ptr32) { handle_irq(i, have_rdtsc ? chrono::rdtsc() : 0); }, { .iret_frame = true, .irq_context = true } }
+            , handler { apic::vector(i), callback.pointer() }
+        { }
+
+        realmode_callback callback;
+        raw_realmode_interrupt_handler handler;
+    };
+
     irq_controller::irq_controller(irq_level i)
-        : irq { i }, prev_handler { get_pm_interrupt_vector(irq_to_vec(i)) }
+        : irq { route(i) }, prev_handler { get_pm_interrupt_vector(irq_to_vec(i)) }
+    {
+        std::unique_ptr<realmode_reflector> r;
+        try
+        {
+            if (apic::routed(irq))
+                r.reset(new (locked) realmode_reflector { irq });
+            const auto p = far_ptr32 { get_cs(), get_trampoline(irq) };
+            set_pm_interrupt_vector(irq_to_vec(irq), p);
+        }
+        catch (...)
+        {
+            apic::unroute(irq);
+            throw;
+        }
+        reflector = r.release();
+    }
+
+    void irq_controller::update_entry_point()
     {
-        const auto p = far_ptr32 { get_cs(), get_trampoline(irq) };
+        const bool use_fast = first != nullptr and first == last
+            and fallback == nullptr and not needs_spurious_check(irq)
+            and (first->flags & fast_irq)
+            and not (first->flags & (always_chain | coalesce));
+        if (use_fast == fast) return;
+        const auto p = far_ptr32 { get_cs(), use_fast ? get_fast_trampoline(irq) : get_trampoline(irq) };
         set_pm_interrupt_vector(irq_to_vec(irq), p);
+        fast = use_fast;
     }
 
     irq_controller::~irq_controller()
     {
+        throttled[irq] = false;
         set_pm_interrupt_vector(irq_to_vec(irq), prev_handler);
+        apic::unroute(irq);
+        delete reflector;
     }
 
     void irq_controller::enable(irq_handler_data* p)
     {
         if (p->enabled) return;
         const auto i = p->irq;
-        if (i >= 16) return;
+        if (i >= irq_count) return;
+        // MSI levels can not be masked by the IOAPIC.
+        if ((p->flags & coalesce) and i >= first_msi_irq)
+            throw std::invalid_argument { fmt::format("IRQ {}: coalesce is not supported on MSI levels", i) };
         auto* e = data->get(i);
         interrupt_mask no_irqs_here { };
         p->enabled = true;
         e->flags |= p->flags;
+        if (p->flags & coalesce)
+            e->window_cycles = chrono::tsc::to_count(std::chrono::microseconds { config::irq_coalesce_window_us });
         irq_mask::unmask(i);
-        if (i > 7) irq_mask::unmask(2);
+        if (i > 7 and not apic::routed(i)) irq_mask::unmask(2);
     }
 
     void irq_controller::disable(irq_handler_data* p)
@@ -318,13 +719,14 @@ namespace jw::dpmi::detail
                 throw std::runtime_error { fmt::format("Multiple devices registered with fallback_handler on IRQ {}", i) };
             e->fallback = p;
         }
+        e->update_entry_point();
         if (enabled) enable(p);
     }
 
     void irq_controller::remove(irq_handler_data* p)
     {
         const auto i = p->irq;
-        if (i >= 16) return;
+        if (i >= irq_count) return;
         auto* const e = data->get(i);
         interrupt_mask no_irqs_here { };
         disable(p);
@@ -337,9 +739,10 @@ namespace jw::dpmi::detail
         }
         else e->fallback = nullptr;
         p->prev = p->next = nullptr;
-        p->irq = 16;
+        p->irq = irq_count;
 
         if (e->first == nullptr) data->remove(i);
+        else e->update_entry_point();
         if (data->allocated.none())
         {
             delete data;
@@ -351,16 +754,16 @@ namespace jw::dpmi::detail
     {
         pic0_cmd.write(0x68);   // TODO: restore to defaults
         pic1_cmd.write(0x68);
-        *reinterpret_cast<std::uint32_t*>(locked_stack.data()) = 0xdeadbeef;
+        have_rdtsc = dpmi::cpuid::feature_flags().time_stamp_counter;
         if constexpr (config::collect_irq_stats)
         {
             spurious = 0;
-            have_rdtsc = dpmi::cpuid::feature_flags().time_stamp_counter;
             for (auto& i : stats.irq)
             {
                 i.min = -1;
                 i.max = 0;
             }
+            deferred_stats.min = -1;
         }
     }
 }
@@ -372,7 +775,7 @@ namespace jw::dpmi
         if constexpr (config::collect_irq_stats)
         {
             auto stats = detail::stats;
-            for (unsigned i = 0; i != 16; ++i)
+            for (unsigned i = 0; i != detail::irq_count; ++i)
             {
                 if (stats.irq[i].count != 0)
                 {
@@ -393,4 +796,61 @@ namespace jw::dpmi
         }
         else return { };
     }
+
+    std::array<locked_stack_stats_t, detail::locked_stack_levels> locked_stack_stats() noexcept
+    {
+        std::array<locked_stack_stats_t, detail::locked_stack_levels> result;
+        interrupt_mask no_irq { };
+        for (std::size_t i = 0; i != result.size(); ++i)
+        {
+            const auto& r = detail::locked_stacks[i];
+            result[i].size = (r.top - r.bottom) * sizeof(std::uint32_t);
+            result[i].used = r.max_used;
+        }
+        return result;
+    }
+
+    interrupt_mask_stats_t interrupt_mask_stats() noexcept
+    {
+        interrupt_mask no_irq { };
+        return detail::mask_stats;
+    }
+
+    void defer(function<void(), 4>&& func)
+    {
+        detail::deferred_item item { std::move(func), 0 };
+        if constexpr (config::collect_irq_stats)
+            if (detail::have_rdtsc) [[likely]]
+                item.posted = chrono::rdtsc();
+
+        if (not detail::deferred.try_push(std::move(item))) [[unlikely]]
+        {
+            if constexpr (config::collect_irq_stats)
+                ++detail::deferred_stats.overflow;
+            item();
+        }
+    }
+
+    deferred_stats_t deferred_stats() noexcept
+    {
+        if constexpr (config::collect_irq_stats)
+        {
+            auto stats = detail::deferred_stats;
+            if (stats.count != 0)
+            {
+                const auto n = std::min<std::uint64_t>(stats.count, detail::deferred_time.size());
+                std::uint64_t sum = 0;
+                for (unsigned j = 0; j != n; ++j)
+                    sum += detail::deferred_time[j];
+                stats.avg = sum / n;
+            }
+            else
+            {
+                stats.avg = 0;
+                stats.min = 0;
+            }
+            return stats;
+        }
+        else return { };
+    }
 }
@@ -2,20 +2,27 @@
 /*    Copyright (C) 2017 - 2025 J.W. Jagersma, see COPYING.txt for details    */
 
 #include <cstring>
+#include <algorithm>
 #include <string_view>
 #include <vector>
+#include <bit>
+#include <atomic>
 #include <crt0.h>
 #include <sys/exceptn.h>
 #include <csignal>
 #include <fmt/core.h>
 #include <jw/main.h>
 #include <jw/alloc.h>
+#include <jw/dpmi/alloc.h>
 #include <jw/debug.h>
+#include <jw/thread.h>
 #include <jw/dpmi/cpu_exception.h>
+#include <jw/dpmi/irq_handler.h>
 #include <jw/io/rs232.h>
 #include <jw/io/ps2_interface.h>
 #include <jw/dpmi/ring0.h>
 #include <jw/dpmi/detail/selectors.h>
+#include <jw/dpmi/detail/apic.h>
 #include <jw/dpmi/cpuid.h>
 #include <jw/dpmi/bda.h>
 #include <jw/video/ansi.h>
@@ -41,6 +48,7 @@ extern "C"
 namespace jw
 {
     static constinit std::optional<dpmi::realmode_interrupt_handler> int2f_handler { std::nullopt };
+    static void locked_pool_refill_thread(std::stop_token);
 
     namespace debug::detail
     {
@@ -192,6 +200,10 @@ int __wrap_main(int argc, const char** argv)
     {
         int2f_handler.emplace(0x2f, [](dpmi::realmode_registers* reg, dpmi::far_ptr32) { return int2f(reg); });
 
+        std::optional<jthread> refill_thread { };
+        if constexpr (config::locked_pool_refill_watermark > 0)
+            refill_thread.emplace(locked_pool_refill_thread);
+
 #ifndef NDEBUG
         if (debug_from_main)
             initial_breakpoint();
@@ -223,6 +235,141 @@ namespace jw
     constinit static std::atomic_flag irq_alloc_resize { false };
     constexpr static std::size_t irq_alloc_size = config::global_locked_pool_size;
     constinit static std::size_t min_chunk_size { 0 };
+    constinit static std::atomic<bool> irq_alloc_refill { false };
+    constinit static jw::detail::wait_queue irq_alloc_refill_waiters { };
+    constinit static std::size_t irq_alloc_refills { 0 };
+    constinit static std::size_t irq_alloc_refill_bytes { 0 };
+    constinit static std::size_t irq_alloc_failures { 0 };
+
+    // Segregated free lists for small locked allocations.  Each 4kB page in
+    // the arena holds blocks of only one size class, so the class of any
+    // block can be found from its address.  Free lists are lock-free stacks
+    // with a generation count in the upper half, to avoid ABA problems when
+    // an interrupt allocates in the middle of a pop.
+    struct locked_slab
+    {
+        static constexpr std::size_t page = 4_KB;
+        static constexpr std::size_t min_shift = 4;
+        static constexpr std::size_t num_classes = dpmi::detail::locked_slab_classes;
+        static constexpr std::size_t max_block = std::size_t { 1 } << (min_shift + num_classes - 1);
+
+        struct size_class
+        {
+            std::uint64_t head;
+            std::atomic<std::size_t> pages;
+            std::atomic<std::size_t> used;
+            std::atomic<std::size_t> peak;
+        };
+
+        static bool cas(std::uint64_t* p, std::uint64_t& expected, std::uint64_t desired) noexcept
+        {
+            bool ok;
+            asm volatile
+            (
+                "lock cmpxchg8b %1"
+                : "=@ccz" (ok)
+                , "+m" (*p)
+                , "+A" (expected)
+                : "b" (static_cast<std::uint32_t>(desired))
+                , "c" (static_cast<std::uint32_t>(desired >> 32))
+                : "memory"
+            );
+            return ok;
+        }
+
+        static std::size_t class_of(std::size_t n, std::size_t a) noexcept
+        {
+            const auto size = std::max({ n, a, std::size_t { 1 } << min_shift });
+            return std::bit_width(size - 1) - min_shift;
+        }
+
+        bool contains(const void* p) const noexcept
+        {
+            const auto* const b = static_cast<const std::byte*>(p);
+            return b >= begin and b < end;
+        }
+
+        std::size_t block_size(const void* p) const noexcept
+        {
+            const auto i = (static_cast<const std::byte*>(p) - begin) / page;
+            return std::size_t { 1 } << (page_class[i] + min_shift);
+        }
+
+        void push(std::size_t c, void* first, void* last) noexcept
+        {
+            auto& list = classes[c];
+            std::uint64_t old = list.head;
+            std::uint64_t desired;
+            do
+            {
+                *static_cast<std::uintptr_t*>(last) = static_cast<std::uint32_t>(old);
+                desired = ((old >> 32) + 1) << 32 | reinterpret_cast<std::uintptr_t>(first);
+            } while (not cas(&list.head, old, desired));
+        }
+
+        void* pop(std::size_t c) noexcept
+        {
+            auto& list = classes[c];
+            std::uint64_t old = list.head;
+            std::uint64_t desired;
+            do
+            {
+                const auto p = static_cast<std::uintptr_t>(old);
+                if (p == 0) return nullptr;
+                const auto next = *reinterpret_cast<volatile std::uintptr_t*>(p);
+                desired = ((old >> 32) + 1) << 32 | next;
+            } while (not cas(&list.head, old, desired));
+            return reinterpret_cast<void*>(static_cast<std::uintptr_t>(old));
+        }
+
+        bool refill(std::size_t c) noexcept
+        {
+            const auto i = next_page.fetch_add(1, std::memory_order_relaxed);
+            if (i >= num_pages) return false;
+            page_class[i] = c;
+
+            const auto size = std::size_t { 1 } << (c + min_shift);
+            auto* const first = begin + i * page;
+            auto* const last = first + page - size;
+            for (auto* p = first; p != last; p += size)
+                *reinterpret_cast<std::byte**>(p) = p + size;
+            classes[c].pages.fetch_add(1, std::memory_order_relaxed);
+            push(c, first, last);
+            return true;
+        }
+
+        void* allocate(std::size_t n, std::size_t a) noexcept
+        {
+            if (n > max_block or a > max_block) return nullptr;
+            const auto c = class_of(n, a);
+            void* p;
+            while ((p = pop(c)) == nullptr)
+                if (not refill(c)) return nullptr;
+
+            auto& list = classes[c];
+            const auto used = list.used.fetch_add(1, std::memory_order_relaxed) + 1;
+            auto peak = list.peak.load(std::memory_order_relaxed);
+            while (used > peak and not list.peak.compare_exchange_weak(peak, used, std::memory_order_relaxed)) { }
+            return p;
+        }
+
+        void deallocate(void* p) noexcept
+        {
+            const auto c = page_class[(static_cast<std::byte*>(p) - begin) / page];
+            classes[c].used.fetch_sub(1, std::memory_order_relaxed);
+            push(c, p, p);
+        }
+
+        std::byte* begin { nullptr };
+        std::byte* end { nullptr };
+        std::size_t num_pages { 0 };
+        std::atomic<std::size_t> next_page { 0 };
+        std::atomic<std::size_t> fallback { 0 };
+        std::uint8_t* page_class { nullptr };
+        size_class classes[num_classes] { };
+    };
+
+    constinit static locked_slab slab { };
 
     struct init
     {
@@ -266,7 +413,7 @@ namespace jw
 
             min_chunk_size = irq_alloc_size;
             locking_allocator<locked_pool_resource> irq_alloc_alloc { };
-            irq_alloc = new (irq_alloc_alloc.allocate(1)) dpmi::locked_pool_resource { irq_alloc_size };
+            irq_alloc = new (irq_alloc_alloc.allocate(1)) dpmi::locked_pool_resource { irq_alloc_size, true };
 
             const_cast<volatile selector&>(safe_ds) = __djgpp_ds_alias;
             const_cast<volatile selector&>(main_cs) = get_cs();
@@ -275,6 +422,21 @@ namespace jw
             cpuid::setup();
             asm volatile ("" ::: "memory");
             const auto cpu = dpmi::cpuid::feature_flags();
+
+            // The slab free lists need cmpxchg8b, which is missing on 486
+            // and some early Pentium clones.  Without it, all locked
+            // allocations go through the irq_alloc pool instead.
+            if constexpr (config::locked_slab_size > 0)
+            {
+                if (cpu.cmpxchg8b)
+                {
+                    slab.num_pages = config::locked_slab_size / locked_slab::page;
+                    slab.page_class = static_cast<std::uint8_t*>(locking_resource()->allocate(slab.num_pages, 1));
+                    slab.begin = static_cast<std::byte*>(locking_resource()->allocate(slab.num_pages * locked_slab::page, locked_slab::page));
+                    slab.end = slab.begin + slab.num_pages * locked_slab::page;
+                }
+            }
+
             const_cast<volatile bool&>(use_fxsave) = cpu.fxsave;
 
             asm volatile
@@ -308,15 +470,35 @@ namespace jw
             bda_memory.emplace(1, far_ptr16 { 0x0040, 0x0000 });
             const_cast<bios_data_area* volatile&>(bda) = bda_memory->near_pointer();
 
+            // Without a usable APIC, all IRQs stay on the PIC.
+            if constexpr (config::enable_apic)
+                if (not apic::setup()) apic::disable();
+
             // Try setting control registers first in ring 3.  If we have no ring0 access, the
             // dpmi host might still trap and emulate control register access.
             bool use_ring0 = false;
+            bool use_clts = false;
+            auto fpu_mode = jw::detail::fpu_switch_mode::eager;
         retry:
             try
             {
                 std::optional<ring0_privilege> r0;
                 if (use_ring0) r0.emplace();
                 set_control_registers(cpu.sse);
+
+                // Lazy FPU switching relies on the device-not-available
+                // exception handler.
+                if constexpr (config::enable_throwing_from_cpu_exceptions)
+                {
+                    fpu_mode = use_ring0 ? jw::detail::fpu_switch_mode::lazy_ring0 : jw::detail::fpu_switch_mode::lazy;
+                    // 'clts' may be allowed where writing CR0 is not.
+                    if (not use_ring0) try
+                    {
+                        clear_task_switched();
+                        use_clts = true;
+                    }
+                    catch (const general_protection_fault&) { }
+                }
             }
             catch (const general_protection_fault&)
             {
@@ -329,6 +511,7 @@ namespace jw
                 // For now, assume that the dpmi server already enabled these bits (HDPMI does this).
                 // If not, then we'll soon crash with an invalid opcode on the first SSE instruction.
             }
+            jw::detail::scheduler::setup_fpu(fpu_mode, use_clts);
 
 #ifndef NDEBUG
             if (const auto* const debugopt = std::getenv("JWDPMI_DEBUG"))
@@ -378,6 +561,12 @@ namespace jw
 
     private:
         [[gnu::noipa]] static void may_throw() { }
+        [[gnu::noipa]] static void clear_task_switched()
+        {
+            may_throw();    // HACK
+            asm volatile ("clts");
+        }
+
         [[gnu::noipa]] static void set_control_registers(bool sse)
         {
             may_throw();    // HACK
@@ -412,6 +601,7 @@ namespace jw
         {
             const auto old_size = [p]
             {
+                if (slab.contains(p)) return slab.block_size(p);
                 if (irq_alloc != nullptr and irq_alloc->in_pool(p)) return irq_alloc->size(p);
                 auto* const q = static_cast<std::uint8_t*>(p);
                 return *reinterpret_cast<std::size_t*>(q - *(q - 1));
@@ -422,34 +612,112 @@ namespace jw
         return new_p;
     }
 
+    // Wake the refill thread.  This may be called from an interrupt handler
+    // or from within the scheduler, so the notification is deferred until
+    // after the outermost interrupt returns.
+    static void request_refill() noexcept
+    {
+        if (irq_alloc_refill.exchange(true)) return;
+        if constexpr (config::locked_pool_refill_watermark > 0)
+            dpmi::defer([] { irq_alloc_refill_waiters.notify_one(); });
+    }
+
     [[nodiscard]] static void* do_locked_alloc(std::size_t size, std::size_t alignment)
     {
         if (irq_alloc == nullptr) throw std::bad_alloc { };
 
+        if constexpr (config::locked_slab_size > 0)
+        {
+            if (slab.begin != nullptr and size <= locked_slab::max_block and alignment <= locked_slab::max_block)
+            {
+                if (auto* p = slab.allocate(size, alignment)) [[likely]] return p;
+                slab.fallback.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
         debug::trap_mask dont_trap_here { };
-        auto* p = irq_alloc->allocate(size, alignment);
+        void* p;
+        try { p = irq_alloc->allocate(size, alignment); }
+        catch (const std::bad_alloc&)
+        {
+            ++irq_alloc_failures;
+            request_refill();
+            throw;
+        }
         min_chunk_size = std::min(min_chunk_size, irq_alloc->max_chunk_size());
+        if (min_chunk_size < config::locked_pool_refill_watermark)
+            request_refill();
         return p;
     }
 
-    static void resize_irq_alloc() noexcept
+    // Allocate and lock a new chunk with interrupts enabled, then add it to
+    // the pool.  Only the last step needs to mask interrupts.
+    static void refill_irq_alloc() noexcept
     {
-        if (min_chunk_size >= irq_alloc_size / 4) [[likely]] return;
         if (irq_alloc == nullptr) return;
         if (irq_alloc_resize.test_and_set()) return;
 
         finally scope_guard { [] { irq_alloc_resize.clear(); } };
-        dpmi::interrupt_mask no_interrupts_here { };
-        debug::trap_mask dont_trap_here { };
-        auto* ia = irq_alloc;
-        irq_alloc = nullptr;
+        irq_alloc_refill = false;
         try
         {
-            ia->grow(irq_alloc_size / 2);
-            min_chunk_size = ia->max_chunk_size();
+            constexpr std::size_t n = irq_alloc_size / 2;
+            auto* const p = static_cast<std::byte*>(dpmi::locking_resource()->allocate(n, __STDCPP_DEFAULT_NEW_ALIGNMENT__));
+            {
+                debug::trap_mask dont_trap_here { };
+                irq_alloc->grow(std::span<std::byte> { p, n });
+            }
+            min_chunk_size = irq_alloc->max_chunk_size();
+            ++irq_alloc_refills;
+            irq_alloc_refill_bytes += n;
         }
         catch (const std::bad_alloc&) { } // Relatively safe to ignore.
-        irq_alloc = ia;
+    }
+
+    static void resize_irq_alloc() noexcept
+    {
+        if (min_chunk_size >= irq_alloc_size / 4) [[likely]] return;
+        refill_irq_alloc();
+    }
+
+    static void locked_pool_refill_thread(std::stop_token stop)
+    {
+        std::stop_callback wake { stop, [] { irq_alloc_refill_waiters.notify_one(); } };
+        while (true)
+        {
+            irq_alloc_refill_waiters.wait_while([&] { return not irq_alloc_refill and not stop.stop_requested(); });
+            if (stop.stop_requested()) return;
+            refill_irq_alloc();
+        }
+    }
+
+    dpmi::locked_pool_stats_t dpmi::locked_pool_stats() noexcept
+    {
+        locked_pool_stats_t s { };
+        if (irq_alloc != nullptr) s.size = irq_alloc->size();
+        s.min_free_chunk = min_chunk_size;
+        s.refills = irq_alloc_refills;
+        s.refill_bytes = irq_alloc_refill_bytes;
+        s.failures = irq_alloc_failures;
+        return s;
+    }
+
+    dpmi::locked_slab_stats_t dpmi::locked_slab_stats() noexcept
+    {
+        locked_slab_stats_t s { };
+        for (std::size_t i = 0; i < locked_slab::num_classes; ++i)
+        {
+            auto& c = slab.classes[i];
+            auto& out = s.size_class[i];
+            out.block_size = std::size_t { 1 } << (i + locked_slab::min_shift);
+            out.pages = c.pages.load(std::memory_order_relaxed);
+            out.used = c.used.load(std::memory_order_relaxed);
+            out.peak = c.peak.load(std::memory_order_relaxed);
+        }
+        s.arena_size = slab.num_pages * locked_slab::page;
+        s.arena_used = std::min(slab.next_page.load(std::memory_order_relaxed), slab.num_pages) * locked_slab::page;
+        s.fallback = slab.fallback.load(std::memory_order_relaxed);
+        return s;
     }
 }
 
@@ -545,6 +813,7 @@ namespace jw
 
     void free_locked(void* p, std::size_t n, std::size_t a)
     {
+        if (slab.contains(p)) return slab.deallocate(p);
         debug::trap_mask dont_trap_here { };
         irq_alloc->deallocate(p, n, a);
     }
@@ -588,7 +857,7 @@ namespace jw
 
 void operator delete(void* ptr, std::size_t n, std::align_val_t a) noexcept
 {
-    if (irq_alloc != nullptr and irq_alloc->in_pool(ptr))
+    if (slab.contains(ptr) or (irq_alloc != nullptr and irq_alloc->in_pool(ptr)))
         free_locked(ptr, n, static_cast<std::size_t>(a));
     else
         free(ptr, n, static_cast<std::size_t>(a));
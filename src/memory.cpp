@@ -2,9 +2,13 @@
 /*    Copyright (C) 2016 - 2025 J.W. Jagersma, see COPYING.txt for details    */
 
 #include <optional>
+#include <bit>
+#include <algorithm>
+#include <stdexcept>
 #include <jw/dpmi/memory.h>
 #include <jw/dpmi/cpu_exception.h>
 #include <jw/dpmi/ring0.h>
+#include <jw/dpmi/realmode.h>
 
 namespace jw::dpmi
 {
@@ -470,6 +474,43 @@ namespace jw::dpmi
         handle = 0;
     }
 
+    void memory_base::get_page_attributes(std::size_t offset, std::span<page_attributes> pages) const
+    {
+        std::uint16_t ax { 0x0506 };
+        bool c;
+        asm volatile
+        (
+            "int 0x31"
+            : "=@ccc" (c)
+            , "+a" (ax)
+            : "S" (handle)
+            , "b" (offset)
+            , "c" (pages.size())
+            , "d" (pages.data())
+            : "memory"
+        );
+        if (c) throw dpmi_error { ax, __PRETTY_FUNCTION__ };
+    }
+
+    void memory_base::set_page_attributes(std::size_t offset, std::span<const page_attributes> pages)
+    {
+        std::uint16_t ax { 0x0507 };
+        std::size_t n { pages.size() };
+        bool c;
+        asm volatile
+        (
+            "int 0x31"
+            : "=@ccc" (c)
+            , "+a" (ax)
+            , "+c" (n)
+            : "S" (handle)
+            , "b" (offset)
+            , "d" (pages.data())
+            : "memory"
+        );
+        if (c) throw dpmi_error { ax, __PRETTY_FUNCTION__ };
+    }
+
     void memory_base::resize(std::size_t num_bytes, bool committed)
     {
         if (dpmi10_alloc_supported)
@@ -719,6 +760,108 @@ namespace jw::dpmi
             return std::nullopt;
     }
 
+    static far_ptr16 xms_entry()
+    {
+        static constinit std::optional<far_ptr16> entry { std::nullopt };
+        if (entry) [[likely]] return *entry;
+
+        realmode_registers reg { };
+        reg.ax = 0x4300;
+        reg.call_int(0x2f);
+        if (reg.al != 0x80) throw dpmi_error { unsupported_function, "XMS driver not found" };
+
+        reg = { };
+        reg.ax = 0x4310;
+        reg.call_int(0x2f);
+        entry = far_ptr16 { reg.es, reg.bx };
+        return *entry;
+    }
+
+    static realmode_registers xms_call(realmode_registers reg)
+    {
+        reg.call_far(xms_entry());
+        return reg;
+    }
+
+    contiguous_memory_base::contiguous_memory_base(std::size_t num_bytes, std::size_t alignment, std::size_t boundary, bool use_dpmi09_alloc)
+        : device_memory_base { no_alloc_tag { }, num_bytes }
+    {
+        if (not std::has_single_bit(alignment))
+            throw std::invalid_argument { "Alignment must be a power of two" };
+        if (boundary != 0 and (not std::has_single_bit(boundary) or boundary < num_bytes or boundary < alignment))
+            throw std::invalid_argument { "Invalid boundary" };
+
+        const std::size_t slack = std::max(alignment, boundary) - 1;
+        const std::uint32_t kb = (num_bytes + slack + 1023) / 1024;
+
+        realmode_registers reg { };
+        reg.ah = 0x89;      // XMS 3.0 allocate any extended memory
+        reg.edx = kb;
+        reg = xms_call(reg);
+        if (reg.ax != 1 and reg.bl == 0x80 and kb <= 0xffff)
+        {
+            reg = { };
+            reg.ah = 0x09;  // XMS 2.0 allocate extended memory
+            reg.dx = kb;
+            reg = xms_call(reg);
+        }
+        if (reg.ax != 1) throw std::bad_alloc { };
+        xms_handle = reg.dx;
+
+        try
+        {
+            reg = { };
+            reg.ah = 0x0c;  // Lock extended memory block
+            reg.dx = xms_handle;
+            reg = xms_call(reg);
+            if (reg.ax != 1) throw std::bad_alloc { };
+
+            const std::uintptr_t base = std::uint32_t { reg.dx } << 16 | reg.bx;
+            std::uintptr_t p = (base + alignment - 1) & -alignment;
+            if (boundary != 0 and (p & -boundary) != ((p + num_bytes - 1) & -boundary))
+                p = (base + boundary - 1) & -boundary;
+
+            phys_addr = p;
+            device_memory_base::allocate(p, use_dpmi09_alloc);
+        }
+        catch (...)
+        {
+            free_xms();
+            throw;
+        }
+    }
+
+    contiguous_memory_base::~contiguous_memory_base()
+    {
+        deallocate();
+    }
+
+    void contiguous_memory_base::deallocate()
+    {
+        device_memory_base::deallocate();
+        addr = 0;
+        free_xms();
+    }
+
+    void contiguous_memory_base::free_xms() noexcept
+    {
+        if (xms_handle == 0) return;
+        try
+        {
+            realmode_registers reg { };
+            reg.ah = 0x0d;      // Unlock extended memory block
+            reg.dx = xms_handle;
+            xms_call(reg);
+            reg = { };
+            reg.ah = 0x0a;      // Free extended memory block
+            reg.dx = xms_handle;
+            xms_call(reg);
+        }
+        catch (...) { }
+        xms_handle = 0;
+        phys_addr = 0;
+    }
+
     void mapped_dos_memory_base::allocate(std::uintptr_t dos_physical_address)
     {
         memory_base::allocate(false, false, 0);
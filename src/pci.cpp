@@ -3,6 +3,7 @@
 
 #include <jw/io/pci.h>
 #include <jw/dpmi/realmode.h>
+#include <jw/dpmi/detail/apic.h>
 #include <map>
 
 namespace jw::io
@@ -100,9 +101,66 @@ namespace jw::io
 
     pci_device::~pci_device()
     {
+        disable_msi();
         (*device_map)[bus][device].erase(function);
         if ((*device_map)[bus][device].empty()) (*device_map)[bus].erase(device);
         if ((*device_map)[bus].empty()) device_map->erase(bus);
         if (device_map->empty()) device_map.reset();
     }
+
+    std::uint8_t pci_device::find_capability(std::uint8_t id) const noexcept
+    {
+        if (not command_and_status().read().status.has_capabilities_list) return 0;
+        std::uint8_t p = capabilities_list().read() & 0xfc;
+        while (p != 0)
+        {
+            const auto r = pci_register<std::uint32_t> { this, p }.read();
+            if ((r & 0xff) == id) return p;
+            p = (r >> 8) & 0xfc;
+        }
+        return 0;
+    }
+
+    dpmi::irq_level pci_device::enable_msi()
+    {
+        using dpmi::detail::apic;
+        if (msi_irq != 0xff) return msi_irq;
+        if (not apic::enabled()) throw unsupported_function { "MSI requires the APIC." };
+        const std::uint8_t cap = find_capability(0x05);
+        if (cap == 0) throw unsupported_function { "Device does not support MSI." };
+
+        const auto irq = apic::allocate_msi();
+        const pci_register<std::uint32_t> control { this, cap };
+        const auto c = control.read();
+        const bool is_64bit = c & (1 << 23);
+        const std::uint8_t data_reg = cap + (is_64bit ? 12 : 8);
+        pci_register<std::uint32_t> { this, static_cast<std::uint8_t>(cap + 4) }.write(apic::msi_address());
+        if (is_64bit) pci_register<std::uint32_t> { this, static_cast<std::uint8_t>(cap + 8) }.write(0);
+        pci_register<std::uint32_t> { this, data_reg }.write(apic::vector(irq));
+
+        // Enable, with a single message.
+        control.write((c & ~(0b111 << 20)) | (1 << 16));
+
+        auto cmd = current_command();
+        cmd.disable_interrupt = true;
+        send_command(cmd);
+
+        msi_irq = irq;
+        return irq;
+    }
+
+    void pci_device::disable_msi() noexcept
+    {
+        if (msi_irq == 0xff) return;
+        const std::uint8_t cap = find_capability(0x05);
+        const pci_register<std::uint32_t> control { this, cap };
+        control.write(control.read() & ~(1 << 16));
+
+        auto cmd = current_command();
+        cmd.disable_interrupt = false;
+        send_command(cmd);
+
+        dpmi::detail::apic::free_msi(msi_irq);
+        msi_irq = 0xff;
+    }
 }
@@ -1,8 +1,12 @@
 /* * * * * * * * * * * * * * * * * * jwdpmi * * * * * * * * * * * * * * * * * */
 /*    Copyright (C) 2017 - 2023 J.W. Jagersma, see COPYING.txt for details    */
 
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
 #include <jw/dpmi/realmode.h>
 #include <jw/dpmi/detail/selectors.h>
+#include <jw/dpmi/detail/apic.h>
 #include <jw/dpmi/detail/interrupt_id.h>
 
 namespace jw::dpmi::detail
@@ -249,6 +253,313 @@ namespace jw
                 , "d" (ptr.offset));
         }
 
+        // Real-mode part of realmode_batch.  Entered with DS:SI pointing to
+        // the first entry.  The offsets here must match realmode_registers.
+        asm
+        (R"(
+            .pushsection .rodata.realmode_batch, "a"
+            .code16
+            .global jw_realmode_batch_stub_begin
+            .global jw_realmode_batch_stub_end
+        jw_realmode_batch_stub_begin:
+        .Lrmb_next:
+            mov al, byte ptr [si + 0x32]        # entry::type
+            test al, al
+            jz .Lrmb_done
+            push ds
+            push si
+            mov dx, word ptr [si + 0x20]        # flags
+            cmp al, 1
+            jne .Lrmb_far
+            push dx                             # Build IRET frame
+            push cs
+            push offset .Lrmb_return - jw_realmode_batch_stub_begin
+            and dx, 0xfcff                      # Clear IF/TF, like INT does
+            movzx bx, byte ptr [si + 0x33]      # entry::interrupt
+            shl bx, 2
+            push 0
+            pop fs
+            push dword ptr fs:[bx]
+            jmp .Lrmb_load
+        .Lrmb_far:
+            push cs                             # Build RETF frame
+            push offset .Lrmb_return - jw_realmode_batch_stub_begin
+            push dword ptr [si + 0x2a]          # cs:ip
+        .Lrmb_load:
+            push dx
+            mov es, word ptr [si + 0x22]
+            mov fs, word ptr [si + 0x26]
+            mov gs, word ptr [si + 0x28]
+            mov edi, dword ptr [si + 0x00]
+            mov ebp, dword ptr [si + 0x08]
+            mov ebx, dword ptr [si + 0x10]
+            mov edx, dword ptr [si + 0x14]
+            mov ecx, dword ptr [si + 0x18]
+            mov eax, dword ptr [si + 0x1c]
+            push dword ptr [si + 0x04]
+            push word ptr [si + 0x24]
+            pop ds
+            pop esi
+            popf
+            retf                                # Jump to target
+        .Lrmb_return:
+            push ebp
+            pushf
+            push ds
+            push esi
+            mov bp, sp
+            mov ds, word ptr [bp + 14]
+            mov si, word ptr [bp + 12]
+            mov dword ptr [si + 0x00], edi
+            mov dword ptr [si + 0x10], ebx
+            mov dword ptr [si + 0x14], edx
+            mov dword ptr [si + 0x18], ecx
+            mov dword ptr [si + 0x1c], eax
+            mov word ptr [si + 0x22], es
+            mov word ptr [si + 0x26], fs
+            mov word ptr [si + 0x28], gs
+            mov eax, dword ptr [bp + 0]
+            mov dword ptr [si + 0x04], eax
+            mov ax, word ptr [bp + 4]
+            mov word ptr [si + 0x24], ax
+            mov ax, word ptr [bp + 6]
+            mov word ptr [si + 0x20], ax
+            mov eax, dword ptr [bp + 8]
+            mov dword ptr [si + 0x08], eax
+            add sp, 16
+            add si, 0x34                        # sizeof(entry)
+            jmp .Lrmb_next
+        .Lrmb_done:
+            retf
+        jw_realmode_batch_stub_end:
+            .code32
+            .popsection
+        )");
+
+        extern "C" const std::byte jw_realmode_batch_stub_begin[];
+        extern "C" const std::byte jw_realmode_batch_stub_end[];
+
+        struct [[gnu::packed]] realmode_batch::entry
+        {
+            enum : std::uint8_t
+            {
+                end,
+                interrupt,
+                far_call
+            };
+
+            realmode_registers reg;
+            std::uint8_t type;
+            std::uint8_t int_num;
+        };
+
+        static std::size_t realmode_batch_entries_offset()
+        {
+            const std::size_t size = jw_realmode_batch_stub_end - jw_realmode_batch_stub_begin;
+            return (size + 0xf) & ~0xf;
+        }
+
+        realmode_batch::realmode_batch(std::size_t n)
+            : max_calls { n }
+            , memory { realmode_batch_entries_offset() + (n + 1) * sizeof(entry) }
+        {
+            static_assert(sizeof(entry) == 0x34);
+            if (memory.dos_pointer().offset + memory.size() > 0x10000)
+                throw std::invalid_argument { "Too many calls in realmode_batch" };
+            std::copy(jw_realmode_batch_stub_begin, jw_realmode_batch_stub_end, memory.near_pointer());
+        }
+
+        auto realmode_batch::entries() const noexcept -> entry*
+        {
+            return reinterpret_cast<entry*>(memory.near_pointer() + realmode_batch_entries_offset());
+        }
+
+        auto realmode_batch::push(const realmode_registers& reg) -> entry*
+        {
+            if (num_calls == max_calls)
+                throw std::length_error { "realmode_batch is full" };
+            auto* const e = entries() + num_calls++;
+            e->reg = reg;
+            return e;
+        }
+
+        realmode_registers& realmode_batch::call_int(std::uint8_t interrupt, const realmode_registers& reg)
+        {
+            auto* const e = push(reg);
+            e->type = entry::interrupt;
+            e->int_num = interrupt;
+            return e->reg;
+        }
+
+        realmode_registers& realmode_batch::call_far(far_ptr16 ptr, const realmode_registers& reg)
+        {
+            auto* const e = push(reg);
+            e->type = entry::far_call;
+            e->reg.ip = ptr.offset;
+            e->reg.cs = ptr.segment;
+            return e->reg;
+        }
+
+        realmode_registers& realmode_batch::operator[](std::size_t i) const noexcept
+        {
+            return entries()[i].reg;
+        }
+
+        void realmode_batch::execute()
+        {
+            if (num_calls == 0) return;
+            entries()[num_calls].type = entry::end;
+
+            const auto p = memory.dos_pointer();
+            realmode_registers reg { };
+            reg.ds = p.segment;
+            reg.si = p.offset + realmode_batch_entries_offset();
+            reg.call_far(p);
+        }
+
+        struct [[gnu::packed]] realmode_irq_buffer::header
+        {
+            std::uint16_t head;
+            std::uint16_t tail;
+            std::uint16_t mask;
+            std::uint16_t data_port;
+            std::uint16_t status_port;
+            std::uint8_t status_mask;
+            std::uint8_t slave;
+            std::uint16_t overflow;
+            std::uint16_t count;
+        };
+
+        // Layout: header at 0x00, code at 0x10, ring buffer at 0x100.
+        static constexpr std::size_t rm_irq_code_offset = 0x10;
+        static constexpr std::size_t rm_irq_ring_offset = 0x100;
+        static constexpr std::uint8_t rm_irq_code[]
+        {
+            0x50,                               //     push ax
+            0x53,                               //     push bx
+            0x52,                               //     push dx
+            0x1e,                               //     push ds
+            0x0e,                               //     push cs
+            0x1f,                               //     pop ds
+            0xff, 0x06, 0x0e, 0x00,             //     inc word ptr [count]
+            0x8b, 0x16, 0x08, 0x00,             // 1:  mov dx, [status_port]
+            0x85, 0xd2,                         //     test dx, dx
+            0x74, 0x07,                         //     jz 2f
+            0xec,                               //     in al, dx
+            0x84, 0x06, 0x0a, 0x00,             //     test [status_mask], al
+            0x74, 0x29,                         //     jz 4f
+            0x8b, 0x16, 0x06, 0x00,             // 2:  mov dx, [data_port]
+            0xec,                               //     in al, dx
+            0x8b, 0x1e, 0x00, 0x00,             //     mov bx, [head]
+            0x88, 0x87, 0x00, 0x01,             //     mov [bx + 0x100], al
+            0x43,                               //     inc bx
+            0x23, 0x1e, 0x04, 0x00,             //     and bx, [mask]
+            0x3b, 0x1e, 0x02, 0x00,             //     cmp bx, [tail]
+            0x74, 0x06,                         //     je 3f
+            0x89, 0x1e, 0x00, 0x00,             //     mov [head], bx
+            0xeb, 0x04,                         //     jmp 5f
+            0xff, 0x06, 0x0c, 0x00,             // 3:  inc word ptr [overflow]
+            0x83, 0x3e, 0x08, 0x00, 0x00,       // 5:  cmp word ptr [status_port], 0
+            0x75, 0xc8,                         //     jne 1b
+            0xb0, 0x20,                         // 4:  mov al, 0x20
+            0x80, 0x3e, 0x0b, 0x00, 0x00,       //     cmp byte ptr [slave], 0
+            0x74, 0x02,                         //     je 6f
+            0xe6, 0xa0,                         //     out 0xa0, al
+            0xe6, 0x20,                         // 6:  out 0x20, al
+            0x1f,                               //     pop ds
+            0x5a,                               //     pop dx
+            0x5b,                               //     pop bx
+            0x58,                               //     pop ax
+            0xcf                                //     iret
+        };
+        static_assert(rm_irq_code_offset + sizeof(rm_irq_code) <= rm_irq_ring_offset);
+
+        static constexpr io::io_port<byte> pic0_data { 0x21 };
+        static constexpr io::io_port<byte> pic1_data { 0xA1 };
+
+        realmode_irq_buffer::realmode_irq_buffer(irq_level i, io::port_num data_port, io::port_num status_port,
+                                                 std::uint8_t status_mask, std::size_t buffer_size)
+            : memory { rm_irq_ring_offset + buffer_size }, irq { i }
+        {
+            static_assert(sizeof(header) == rm_irq_code_offset);
+            if (irq >= 16)
+                throw std::invalid_argument { "Invalid IRQ level" };
+            if (buffer_size == 0 or buffer_size > 0x8000 or (buffer_size & (buffer_size - 1)) != 0)
+                throw std::invalid_argument { "Buffer size must be a power of two, up to 32kB" };
+            if (detail::apic::routed(irq))
+                throw std::invalid_argument { "IRQ is routed through the APIC" };
+
+            auto* const p = memory.near_pointer();
+            std::fill_n(p, rm_irq_ring_offset, std::byte { 0 });
+            std::copy_n(reinterpret_cast<const std::byte*>(rm_irq_code), sizeof(rm_irq_code), p + rm_irq_code_offset);
+
+            auto* const h = get_header();
+            h->mask = static_cast<std::uint16_t>(buffer_size - 1);
+            h->data_port = data_port;
+            h->status_port = status_port;
+            h->status_mask = status_port != 0 ? status_mask : 0;
+            h->slave = irq >= 8;
+
+            // DOS allocations are paragraph-aligned, so the offset is always 0.
+            const auto seg = memory.dos_pointer().segment;
+            static const dpmi::version ver { };
+            const std::uint8_t vec = irq < 8 ? ver.pic_master_base + irq : ver.pic_slave_base + irq - 8;
+            interrupt_mask no_irqs_here { };
+            handler.emplace(vec, far_ptr16 { seg, static_cast<std::uint16_t>(rm_irq_code_offset) });
+
+            // The BIOS may leave this line masked, eg. for a UART.
+            was_masked = (irq < 8 ? pic0_data : pic1_data).read() & (1 << (irq % 8));
+            irq_mask::unmask(irq);
+            if (irq >= 8) irq_mask::unmask(2);
+        }
+
+        realmode_irq_buffer::~realmode_irq_buffer()
+        {
+            if (not was_masked) return;
+            interrupt_mask no_irqs_here { };
+            auto& port = irq < 8 ? pic0_data : pic1_data;
+            port.write(port.read() | (1 << (irq % 8)));
+        }
+
+        auto realmode_irq_buffer::get_header() const noexcept -> volatile header*
+        {
+            return reinterpret_cast<volatile header*>(memory.near_pointer());
+        }
+
+        std::size_t realmode_irq_buffer::read(std::span<std::byte> out) noexcept
+        {
+            auto* const h = get_header();
+            const auto* const ring = memory.near_pointer() + rm_irq_ring_offset;
+            const std::uint16_t mask = h->mask;
+            const std::uint16_t head = h->head;
+            std::uint16_t tail = h->tail;
+            std::size_t n = 0;
+            while (tail != head and n < out.size())
+            {
+                out[n++] = ring[tail];
+                tail = (tail + 1) & mask;
+            }
+            std::atomic_signal_fence(std::memory_order_release);
+            h->tail = tail;
+            return n;
+        }
+
+        std::size_t realmode_irq_buffer::size() const noexcept
+        {
+            auto* const h = get_header();
+            return (h->head - h->tail) & h->mask;
+        }
+
+        std::uint16_t realmode_irq_buffer::overflows() const noexcept
+        {
+            return get_header()->overflow;
+        }
+
+        std::uint16_t realmode_irq_buffer::interrupts() const noexcept
+        {
+            return get_header()->count;
+        }
+
         void realmode_interrupt_handler::init()
         {
             if (not rm_int_callbacks.has_value()) [[unlikely]] rm_int_callbacks.emplace();
@@ -5,6 +5,8 @@
 
 #include <jw/dpmi/ring0.h>
 #include <jw/dpmi/detail/selectors.h>
+#include <jw/dpmi/cpuid.h>
+#include <bit>
 
 namespace jw::dpmi
 {
@@ -138,4 +140,121 @@ namespace jw::dpmi
             : "eax", "edx"
         );
     }
+
+    static std::uint64_t rdmsr(std::uint32_t msr) noexcept
+    {
+        std::uint64_t value;
+        asm volatile ("rdmsr" : "=A" (value) : "c" (msr));
+        return value;
+    }
+
+    static void wrmsr(std::uint32_t msr, std::uint64_t value) noexcept
+    {
+        asm volatile ("wrmsr" :: "c" (msr), "A" (value));
+    }
+
+    static void flush_tlb() noexcept
+    {
+        std::uint32_t cr3;
+        asm volatile ("mov %0, cr3" : "=r" (cr3));
+        asm volatile ("mov cr3, %0" :: "r" (cr3) : "memory");
+    }
+
+    // Procedure from the Intel SDM vol. 3, 11.11.7.2.  Must be called in
+    // ring 0, with interrupts disabled.
+    template<typename F>
+    static void update_mtrrs(F&& func)
+    {
+        std::uint32_t cr0, cr4;
+        asm volatile ("mov %0, cr0" : "=r" (cr0));
+        asm volatile ("mov %0, cr4" : "=r" (cr4));
+
+        // Enter no-fill cache mode.
+        asm volatile ("mov cr0, %0; wbinvd" :: "r" ((cr0 | 0x40000000) & ~0x20000000) : "memory");
+        if (cr4 & 0x80) asm volatile ("mov cr4, %0" :: "r" (cr4 & ~0x80) : "memory");
+        else flush_tlb();
+
+        const auto def_type = rdmsr(0x2ff);
+        wrmsr(0x2ff, def_type & ~0x800);
+
+        func();
+
+        asm volatile ("wbinvd" ::: "memory");
+        flush_tlb();
+        wrmsr(0x2ff, def_type);
+
+        asm volatile ("mov cr0, %0" :: "r" (cr0) : "memory");
+        if (cr4 & 0x80) asm volatile ("mov cr4, %0" :: "r" (cr4) : "memory");
+    }
+
+    write_combining::write_combining(std::uintptr_t physical_address, std::size_t size) noexcept
+    {
+        if (size == 0) return;
+        if (not cpuid::feature_flags().memory_type_range_registers) return;
+        if (not ring0_privilege::wont_throw()) return;
+
+        try
+        {
+            ring0_privilege r0 { };
+
+            const auto cap = rdmsr(0xfe);
+            if ((cap & 0x400) == 0) return;     // Write-combining not supported
+            const unsigned count = std::min<unsigned>(cap & 0xff, 32);
+
+            std::uint32_t free { 0 };
+            for (unsigned i = 0; i < count; ++i)
+                if ((rdmsr(0x201 + 2 * i) & 0x800) == 0) free |= 1 << i;
+
+            const unsigned phys_bits = cpuid::max_extended() >= 8 ? cpuid::extended_leaf(8).eax & 0xff : 36;
+            const std::uint64_t phys_mask = (std::uint64_t { 1 } << phys_bits) - 1;
+
+            // Split the range into naturally aligned power-of-two blocks,
+            // one for each MTRR.
+            struct block { std::uint64_t base, size; } blocks[32];
+            unsigned n = 0;
+            std::uint64_t b = physical_address & -0x1000;
+            const std::uint64_t end = (std::uint64_t { physical_address } + size + 0xfff) & -0x1000;
+            while (b < end)
+            {
+                if (n == static_cast<unsigned>(std::popcount(free))) return;
+                std::uint64_t s = b != 0 ? b & -b : std::uint64_t { 1 } << 32;
+                while (b + s > end) s >>= 1;
+                blocks[n++] = { b, s };
+                b += s;
+            }
+
+            update_mtrrs([&]
+            {
+                unsigned j = 0;
+                for (unsigned i = 0; i < count and j < n; ++i)
+                {
+                    if ((free & (1 << i)) == 0) continue;
+                    wrmsr(0x200 + 2 * i, blocks[j].base | 1);   // Type 1: write-combining
+                    wrmsr(0x201 + 2 * i, (~(blocks[j].size - 1) & phys_mask & -0x1000) | 0x800);
+                    mtrrs |= 1 << i;
+                    ++j;
+                }
+            });
+        }
+        catch (...) { }
+    }
+
+    write_combining::~write_combining()
+    {
+        if (mtrrs == 0) return;
+        try
+        {
+            ring0_privilege r0 { };
+            update_mtrrs([this]
+            {
+                for (unsigned i = 0; i < 32; ++i)
+                {
+                    if ((mtrrs & (1 << i)) == 0) continue;
+                    wrmsr(0x201 + 2 * i, 0);
+                    wrmsr(0x200 + 2 * i, 0);
+                }
+            });
+        }
+        catch (...) { }
+    }
 }
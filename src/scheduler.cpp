@@ -6,10 +6,14 @@
 #include <jw/detail/scheduler.h>
 #include <jw/thread.h>
 #include <jw/dpmi/realmode.h>
+#include <jw/dpmi/ring0.h>
+#include <jw/dpmi/cpuid.h>
+#include <jw/dpmi/irq_handler.h>
 #include <fmt/format.h>
 #include <cxxabi.h>
 #include <unwind.h>
 #include <algorithm>
+#include <bit>
 #include <memory_resource>
 #ifdef JWDPMI_WITH_WATT32
 # include <tcp.h>
@@ -30,13 +34,21 @@ namespace jw::detail
     {
         memres.emplace(64_KB);
         threads.emplace(memory_resource());
+        sleep_queue.emplace(memory_resource());
 
         thread& p = const_cast<thread&>(*threads->emplace().first);
         p.state = thread::running;
         p.set_name("Main thread");
         debug::throw_assert(p.id == thread::main_thread_id);
 
-        iterator.emplace(threads->begin());
+        ready_queue(&p).push_back(&p);
+        current = &p;
+        fpu_owner = &p;
+
+        // Also needed by setup_fpu().
+        have_tsc = dpmi::cpuid::feature_flags().time_stamp_counter;
+        if constexpr (config::collect_thread_stats)
+            if (have_tsc) p.runnable_since = switched_in = chrono::rdtsc();
 
 #       ifdef JWDPMI_WITH_WATT32
         sock_yield(nullptr, safe_yield);
@@ -45,6 +57,7 @@ namespace jw::detail
 
     void scheduler::kill_all()
     {
+        finally clear_stacks { [] { dead.reset(); thread_stack::clear_cache(); } };
         auto* main = get_thread(thread::main_thread_id);
         atexit(main);
         if (threads->size() == 1) [[likely]] return;
@@ -122,8 +135,20 @@ namespace jw::detail
                 if (not ct->unwinding and std::uncaught_exceptions() == 0)
                     forced_unwind();
 
-        while (not ct->invoke_list.empty()) [[unlikely]]
+        dpmi::detail::run_deferred();
+        dpmi::detail::irq_controller::poll();
+        ct->mailbox.run();
+
+        while (ct->invoke_overflow) [[unlikely]]
         {
+            {
+                dpmi::interrupt_mask no_interrupts_please { };
+                if (ct->invoke_list.empty())
+                {
+                    ct->invoke_overflow = false;
+                    break;
+                }
+            }
             finally pop { [ct]
             {
                 asm ("cli");
@@ -142,6 +167,47 @@ namespace jw::detail
     void scheduler::yield()      { do_yield<true>(); }
     void scheduler::safe_yield() { do_yield<false>(); }
 
+    // Sleep queue is a min-heap ordered on wake time.
+    static constexpr auto wakes_later = [](const auto& a, const auto& b) { return a.wake_time > b.wake_time; };
+
+    void scheduler::sleep_until(chrono::tsc_count wake_time)
+    {
+        if (dpmi::in_irq_context()) [[unlikely]] return;
+
+        {
+            dpmi::interrupt_mask no_interrupts_please { };
+            block(parked, wake_time);
+        }
+        yield();
+    }
+
+    // Same as block(), but also place the current thread on the sleep queue.
+    void scheduler::block(thread_queue& q, chrono::tsc_count wake_time)
+    {
+        auto* const ct = current_thread();
+        sleep_queue->push_back({ wake_time, ct });
+        std::push_heap(sleep_queue->begin(), sleep_queue->end(), wakes_later);
+        ct->wake_time = wake_time;
+        ct->sleeping = true;
+        block(q);
+    }
+
+    // Wake up all threads whose deadline has passed.  Entries for threads
+    // that were woken early are stale, and simply discarded here.
+    void scheduler::wake_sleepers() noexcept
+    {
+        auto& q = *sleep_queue;
+        const auto now = chrono::rdtsc();
+        while (not q.empty() and q.front().wake_time <= now)
+        {
+            auto* const t = q.front().t;
+            if (t->sleeping and t->wake_time == q.front().wake_time)
+                t->wake();
+            std::pop_heap(q.begin(), q.end(), wakes_later);
+            q.pop_back();
+        }
+    }
+
     // The actual thread.
     void scheduler::run_thread() noexcept
     {
@@ -181,41 +247,84 @@ namespace jw::detail
     {
         dpmi::async_signal_mask disable_signals { };
         thread* ct = current_thread();
+        dead.reset();
 
         ct->eh_globals = *abi::__cxa_get_globals();
         ct->errno = errno;
 
-        do
+        if constexpr (config::collect_thread_stats)
+            if (have_tsc) [[likely]]
+                ct->stats.cycles += chrono::rdtsc() - switched_in;
+
         {
+            dpmi::interrupt_mask no_interrupts_please { };
+            if (is_ready(ct)) [[likely]]
             {
-                finally sti { [] { asm ("sti"); } };
-                auto it = *iterator;
-                if (ct->active() | not ct->detached) [[likely]]
-                    ++it;
+                // Move the current thread to the back of its queue.
+                if (ct->active()) [[likely]] make_ready(ct);
                 else
                 {
-                    // Interrupts are always enabled here (by yield()).
-                    asm ("cli");
-                    it = threads->erase(it);
+                    ready_queue(ct).erase(ct);
+                    retire(ct);
                 }
-                if (it == threads->end())
-                    it = threads->begin();
-                std::atomic_ref { *iterator }.store(it, std::memory_order_release);
             }
+        }
 
-            ct = current_thread();
+        if (not sleep_queue->empty()) [[unlikely]]
+            wake_sleepers();
 
-            if (ct->state == thread::starting) [[unlikely]]     // new thread, initialize new context on stack
+        while (true)
+        {
+            dpmi::interrupt_mask no_interrupts_please { };
+            auto* const q = select_queue();
+            if (q == nullptr) [[unlikely]]
             {
-#               ifndef NDEBUG
-                *reinterpret_cast<std::uint32_t*>(ct->stack.data()) = 0xDEADBEEF;   // stack overflow protection
-#               endif
-                void* const esp = (ct->stack.data() + ct->stack.size_bytes() - 4) - sizeof(thread_context);
-                ct->context = new (esp) thread_context { *threads->begin()->context };    // clone context from main thread
-                ct->context->ebp = 0;
-                ct->context->return_address = reinterpret_cast<std::uintptr_t>(run_thread);
+                // Nothing to do.  Wait for an interrupt or sleeper to wake
+                // up a thread.
+                dpmi::interrupt_unmask allow_interrupts { };
+                if (not sleep_queue->empty())
+                    wake_sleepers();
+                continue;
+            }
+            ct = q->front();
+            if (ct->suspended) [[unlikely]]
+            {
+                move(ct, suspended);
+                continue;
+            }
+            if (not ct->active()) [[unlikely]]
+            {
+                q->erase(ct);
+                retire(ct);
+                continue;
             }
-        } while (ct->suspended | not ct->active());
+            break;
+        }
+
+        if constexpr (config::collect_thread_stats)
+            if (have_tsc) [[likely]]
+                account_switch(ct);
+
+        std::atomic_ref { current }.store(ct, std::memory_order_release);
+
+        if (ct->state == thread::starting) [[unlikely]]     // new thread, initialize new context on stack
+        {
+            if constexpr (config::collect_thread_stats)     // fill stack to measure usage
+                std::fill_n(reinterpret_cast<std::uint32_t*>(ct->stack.data()), ct->stack.size_bytes() / 4, 0xDEADBEEF);
+#           ifndef NDEBUG
+            *reinterpret_cast<std::uint32_t*>(ct->stack.data()) = 0xDEADBEEF;   // stack overflow protection
+#           endif
+            void* const esp = (ct->stack.data() + ct->stack.size_bytes() - 4) - sizeof(thread_context);
+            ct->context = new (esp) thread_context { *threads->begin()->context };    // clone context from main thread
+            ct->context->ebp = 0;
+            ct->context->return_address = reinterpret_cast<std::uintptr_t>(run_thread);
+        }
+
+        if constexpr (config::thread_save_fpu)
+        {
+            dpmi::interrupt_mask no_interrupts_please { };
+            switch_fpu(ct);
+        }
 
         *abi::__cxa_get_globals() = ct->eh_globals;
         errno = ct->errno;
@@ -223,6 +332,166 @@ namespace jw::detail
         return ct->context;
     }
 
+    void scheduler::account_switch(thread* t) noexcept
+    {
+        const auto now = chrono::rdtsc();
+        const auto latency = static_cast<std::uint32_t>(std::min<chrono::tsc_count>(now - t->runnable_since, std::numeric_limits<std::uint32_t>::max()));
+        auto& s = t->stats;
+        const auto bucket = std::min<std::size_t>(std::bit_width(latency >> 10), s.latency_histogram.size() - 1);
+        ++s.switches;
+        ++s.latency_histogram[bucket];
+        s.max_latency = std::max(s.max_latency, latency);
+        t->latency_sum += latency;
+        switched_in = now;
+    }
+
+    thread_stats_t thread::get_stats() const noexcept
+    {
+        thread_stats_t s;
+        std::uint64_t sum;
+        {
+            dpmi::interrupt_mask no_interrupts_please { };
+            s = stats;
+            sum = latency_sum;
+            if (config::collect_thread_stats and scheduler::have_tsc and scheduler::current == this)
+                s.cycles += chrono::rdtsc() - scheduler::switched_in;
+        }
+        s.avg_latency = s.switches != 0 ? sum / s.switches : 0;
+        s.stack_used = 0;
+        if constexpr (config::collect_thread_stats)
+        {
+            const auto* const begin = reinterpret_cast<const std::uint32_t*>(stack.data());
+            const auto* const end = begin + stack.size_bytes() / 4;
+            const auto* const p = std::find_if(begin, end, [](std::uint32_t x) { return x != 0xDEADBEEF; });
+            s.stack_used = (end - p) * 4;
+        }
+        return s;
+    }
+
+    void scheduler::setup_fpu(fpu_switch_mode mode, bool clts)
+    {
+        if constexpr (not config::thread_save_fpu) return;
+        dpmi::interrupt_mask no_interrupts_please { };
+        initial_fpu.save();
+        initial_fpu.restore();
+        fpu_clts = clts;
+
+        // Lazy switching only pays off if a full trap round trip (set CR0.TS,
+        // take the #NM exception, clear CR0.TS) is cheaper than saving and
+        // restoring the FPU state.  When the DPMI host traps CR0 access, or
+        // it takes a ring 0 transition, it usually isn't.
+        if (mode != fpu_switch_mode::eager and have_tsc)
+        {
+            fpu_mode = mode;
+            const auto t0 = chrono::rdtsc();
+            for (unsigned i = 0; i < 4; ++i)
+            {
+                set_fpu_trap(true);
+                asm volatile ("fnop");  // handled by handle_fpu_trap()
+            }
+            const auto t1 = chrono::rdtsc();
+            for (unsigned i = 0; i < 4; ++i)
+            {
+                initial_fpu.save();
+                initial_fpu.restore();
+            }
+            const auto t2 = chrono::rdtsc();
+            if (t1 - t0 >= t2 - t1) mode = fpu_switch_mode::eager;
+        }
+        else mode = fpu_switch_mode::eager;
+        fpu_mode = mode;
+    }
+
+    // Make the FPU registers available to the given thread, either now or
+    // when it first executes an FPU instruction.  In lazy mode, CR0.TS is
+    // only set here, and cleared by the trap handler.  Switching between
+    // threads that don't touch the FPU then costs nothing.
+    void scheduler::switch_fpu(thread* t) noexcept
+    {
+        if (fpu_mode == fpu_switch_mode::eager) load_fpu(t);
+        else if (t != fpu_owner) set_fpu_trap(true);
+    }
+
+    // Save the FPU registers for their previous owner, and load them for
+    // the given thread.
+    void scheduler::load_fpu(thread* t) noexcept
+    {
+        if (fpu_owner == t) return;
+        if (fpu_owner != nullptr) fpu_owner->fpu.save();
+        t->fpu.restore();
+        fpu_owner = t;
+    }
+
+    // Set or clear CR0.TS.  While set, any FPU instruction raises a
+    // device-not-available exception.
+    void scheduler::set_fpu_trap(bool enable) noexcept
+    {
+        if (enable == fpu_trap) return;
+        const bool clts = not enable and fpu_clts;
+        std::optional<dpmi::ring0_privilege> r0;
+        if (fpu_mode == fpu_switch_mode::lazy_ring0 and not clts) r0.emplace();
+        if (clts or (not enable and r0))
+            asm volatile ("clts");
+        else
+        {
+            std::uint32_t cr0;
+            asm volatile ("mov %0, cr0" : "=r" (cr0));
+            if (enable) cr0 |= 0x08;
+            else cr0 &= ~0x08;
+            asm volatile ("mov cr0, %0" :: "r" (cr0));
+        }
+        fpu_trap = enable;
+    }
+
+    bool scheduler::handle_fpu_trap() noexcept
+    {
+        if (not fpu_trap) return false;
+        set_fpu_trap(false);
+        load_fpu(current);
+        return true;
+    }
+
+    // Returns the highest-priority non-empty run queue, unless a lower
+    // priority has been passed over too many times.  Returns nullptr if no
+    // threads are runnable.
+    thread_queue* scheduler::select_queue() noexcept
+    {
+        thread_queue* q = nullptr;
+        bool starved = false;
+        for (auto i = num_priorities; i-- > 0;)
+        {
+            if (ready[i].empty()) continue;
+            if (q == nullptr) q = &ready[i];
+            else if (++passed_over[i] >= config::thread_starvation_limit and not starved)
+            {
+                q = &ready[i];
+                starved = true;
+            }
+        }
+        if (q != nullptr) passed_over[q - ready.data()] = 0;
+        return q;
+    }
+
+    // Dispose of a finished thread.  Wakes up any threads waiting in join().
+    // Detached threads are destroyed here, others are parked until join()
+    // or detach() is called.
+    void scheduler::retire(thread* t) noexcept
+    {
+        if (fpu_owner == t) fpu_owner = nullptr;
+        t->exit_queue.notify_all();
+        if (not t->detached)
+        {
+            parked.push_back(t);
+            return;
+        }
+        std::erase_if(*sleep_queue, [t](const sleeper& s) { return s.t == t; });
+        std::make_heap(sleep_queue->begin(), sleep_queue->end(), wakes_later);
+        const auto i = threads->find(t->id);
+        // Switching away from the current thread still uses its stack.
+        if (t == current) dead.emplace(threads->extract(i));
+        else threads->erase(i);
+    }
+
     void scheduler::atexit(thread* t) noexcept
     {
         for (const auto& f : t->atexit_list)
@@ -288,6 +557,101 @@ namespace jw::detail
     }
 }
 
+namespace jw::detail
+{
+    struct stack_cache_bin
+    {
+        std::array<thread_stack, config::thread_stack_cache_size> stacks;
+        std::size_t count { 0 };
+    };
+
+    static constexpr std::size_t min_stack_size = 4_KB;
+    static constinit std::array<stack_cache_bin, 8> stack_cache { };
+    static constinit bool stack_caching { true };
+    static constinit bool guard_pages { config::thread_guard_pages };
+
+    // Stacks of (min_stack_size << i) bytes go in stack_cache[i].
+    static std::size_t stack_size_class(std::size_t bytes) noexcept
+    {
+        if (bytes <= min_stack_size) return 0;
+        return std::bit_width((bytes - 1) / min_stack_size);
+    }
+
+    thread_stack::thread_stack(thread_stack&& other) noexcept
+        : memory { std::exchange(other.memory, { }) }
+        , block { std::move(other.block) }
+    {
+        other.block.reset();
+    }
+
+    thread_stack& thread_stack::operator=(thread_stack&& other) noexcept
+    {
+        std::swap(memory, other.memory);
+        std::swap(block, other.block);
+        return *this;
+    }
+
+    thread_stack::~thread_stack()
+    {
+        if (memory.empty() or block) return;
+        thread::memres.deallocate(memory.data(), memory.size_bytes(), 0x10);
+    }
+
+    thread_stack thread_stack::allocate(std::size_t bytes)
+    {
+        const auto i = stack_size_class(bytes);
+        std::size_t size;
+        if (i < stack_cache.size())
+        {
+            auto& bin = stack_cache[i];
+            if (bin.count > 0) return std::move(bin.stacks[--bin.count]);
+            size = min_stack_size << i;
+        }
+        else size = dpmi::round_up_to_page_size(bytes);
+
+        thread_stack s { };
+        if (guard_pages)
+        {
+            try
+            {
+                const dpmi::page_attributes guard { dpmi::page_attributes::uncommitted, false };
+                s.block.emplace(size + dpmi::page_size, true);
+                s.block->set_page_attributes(0, { &guard, 1 });
+                s.memory = { s.block->near_pointer<std::byte>() + dpmi::page_size, size };
+                return s;
+            }
+            catch (const dpmi::dpmi_error&)
+            {
+                s.block.reset();
+                guard_pages = false;
+            }
+        }
+
+        auto* const p = thread::memres.allocate(size, 0x10);
+        s.memory = { static_cast<std::byte*>(p), size };
+        return s;
+    }
+
+    void thread_stack::release(thread_stack&& s) noexcept
+    {
+        thread_stack discard { std::move(s) };
+        if (discard.memory.empty() or not stack_caching) return;
+        const auto i = stack_size_class(discard.size_bytes());
+        if (i >= stack_cache.size()) return;
+        auto& bin = stack_cache[i];
+        if (bin.count < bin.stacks.size())
+            bin.stacks[bin.count++] = std::move(discard);
+    }
+
+    void thread_stack::clear_cache() noexcept
+    {
+        stack_caching = false;
+        for (auto& bin : stack_cache)
+            while (bin.count > 0)
+                bin.stacks[--bin.count] = { };
+    }
+}
+
 namespace jw
 {
     void terminate()
@@ -0,0 +1,78 @@
+/* * * * * * * * * * * * * * * * * * jwdpmi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2026 - 2026 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <algorithm>
+#include <jw/task.h>
+
+namespace jw
+{
+    template<typename T>
+    static bool timer_later(const T& a, const T& b) noexcept { return a.time > b.time; }
+
+    executor::~executor()
+    {
+        worker.request_stop();
+        notify();
+        worker.join();
+        while (roots != nullptr)
+        {
+            auto* r = roots;
+            roots = r->next;
+            std::coroutine_handle<detail::spawned_task::promise_type>::from_promise(*r).destroy();
+        }
+    }
+
+    void executor::add_timer(clock::time_point t, std::coroutine_handle<> h)
+    {
+        timers.push_back({ t, h });
+        std::push_heap(timers.begin(), timers.end(), timer_later<timer>);
+    }
+
+    void executor::run(std::stop_token stop)
+    {
+        while (not stop.stop_requested())
+        {
+            notified = false;
+
+            const auto now = clock::now();
+            while (not timers.empty() and timers.front().time <= now)
+            {
+                std::pop_heap(timers.begin(), timers.end(), timer_later<timer>);
+                ready.push_back(timers.back().handle);
+                timers.pop_back();
+            }
+
+            // Awaitables that can't notify keep the executor from blocking.
+            bool spin = false;
+            std::erase_if(polling, [this, &spin](detail::poll_awaiter* p)
+            {
+                if (not p->poll())
+                {
+                    spin |= not p->notifying;
+                    return false;
+                }
+                ready.push_back(p->handle);
+                return true;
+            });
+
+            if (not ready.empty())
+            {
+                // Only resume the tasks that were ready on entry, so that a
+                // task which yields in a loop doesn't starve the rest.
+                for (auto n = ready.size(); n > 0; --n)
+                {
+                    auto h = ready.front();
+                    ready.pop_front();
+                    h.resume();
+                }
+                this_thread::yield();
+            }
+            else if (spin)
+                this_thread::yield();
+            else if (not timers.empty())
+                wake.wait_while_until([this] { return not notified; }, timers.front().time);
+            else
+                wake.wait_while([this, &stop] { return not notified and not stop.stop_requested(); });
+        }
+    }
+}